@@ -0,0 +1,114 @@
+# Generates the images the benchmark suite runs over: a JPEG, TIFF, PNG and DNG with each
+# of a small, medium and large block of IPTC and XMP data. The large blocks have over a
+# thousand entries, like images that have been through a few asset managers. The images
+# themselves are tiny, so it's the metadata that's measured.
+require 'fileutils'
+require 'zlib'
+require 'exiv2'
+
+module Bench
+  module Corpus
+    DIR = File.expand_path("corpus", __dir__)
+    SIZES = { "small" => 10, "medium" => 100, "large" => 1200 }
+    FORMATS = %w[jpg tif png dng]
+
+    # The paths of the images, generating them first if they haven't been.
+    def self.paths
+      generate unless File.exist?(File.join(DIR, ".complete"))
+      SIZES.keys.product(FORMATS).map { |size, format| File.join(DIR, "#{size}.#{format}") }
+    end
+
+    def self.generate
+      FileUtils.mkdir_p(DIR)
+
+      SIZES.each do |size, entries|
+        FORMATS.each do |format|
+          path = File.join(DIR, "#{size}.#{format}")
+          File.binwrite(path, blank(format))
+          fill(path, entries)
+        end
+      end
+
+      FileUtils.touch(File.join(DIR, ".complete"))
+    end
+
+    def self.fill(path, entries)
+      image = Exiv2::ImageFactory.open(path)
+      image.read_metadata
+
+      image.exif_data.update(
+        "Exif.Image.Make" => "Bench",
+        "Exif.Image.Model" => "Corpus #{entries}",
+        "Exif.Photo.DateTimeOriginal" => "2024:01:02 03:04:05",
+        "Exif.Photo.ExposureTime" => "1/125",
+        "Exif.Photo.FNumber" => "28/10",
+        "Exif.Photo.FocalLength" => "50/1",
+        "Exif.GPSInfo.GPSLatitudeRef" => "N",
+        "Exif.GPSInfo.GPSLatitude" => "51/1 30/1 2654/100",
+        "Exif.GPSInfo.GPSLongitudeRef" => "W",
+        "Exif.GPSInfo.GPSLongitude" => "0/1 7/1 3978/100"
+      )
+      image.iptc_data.update(
+        "Iptc.Application2.Caption" => "Benchmark image with #{entries} keywords",
+        "Iptc.Application2.Byline" => "Bench",
+        "Iptc.Application2.Keywords" => Array.new(entries) { |i| "keyword #{i}" }
+      )
+      image.xmp_data.update(
+        "Xmp.dc.title" => "Benchmark image",
+        "Xmp.dc.creator" => "Bench",
+        "Xmp.dc.subject" => Array.new(entries) { |i| "subject #{i}" },
+        "Xmp.xmp.Rating" => "3"
+      )
+
+      image.write_metadata
+    end
+
+    def self.blank(format)
+      case format
+      when "jpg" then File.binread(File.expand_path("../spec/files/test.jpg", __dir__))
+      when "png" then png
+      when "tif" then tiff(dng: false)
+      when "dng" then tiff(dng: true)
+      end
+    end
+
+    # A 1x1 greyscale PNG.
+    def self.png
+      chunk = lambda do |type, data|
+        [data.bytesize].pack("N") + type + data + [Zlib.crc32(type + data)].pack("N")
+      end
+
+      "\x89PNG\r\n\x1a\n".b +
+        chunk.call("IHDR", [1, 1, 8, 0, 0, 0, 0].pack("NNCCCCC")) +
+        chunk.call("IDAT", Zlib::Deflate.deflate("\0\x80".b)) +
+        chunk.call("IEND", "".b)
+    end
+
+    # A 1x1 greyscale, uncompressed, little-endian TIFF. The DNG is the same with a
+    # DNGVersion tag.
+    def self.tiff(dng:)
+      short = ->(tag, value) { [tag, 3, 1, value, 0].pack("vvVvv") }
+      long = ->(tag, value) { [tag, 4, 1, value].pack("vvVV") }
+
+      entries = 9 + (dng ? 1 : 0)
+      pixels = 8 + 2 + entries * 12 + 4
+
+      ifd = [
+        short.call(256, 1),       # ImageWidth
+        short.call(257, 1),       # ImageLength
+        short.call(258, 8),       # BitsPerSample
+        short.call(259, 1),       # Compression: none
+        short.call(262, 1),       # PhotometricInterpretation: black is zero
+        long.call(273, pixels),   # StripOffsets
+        short.call(277, 1),       # SamplesPerPixel
+        short.call(278, 1),       # RowsPerStrip
+        long.call(279, 1),        # StripByteCounts
+      ]
+      ifd << [50706, 1, 4, 1, 4, 0, 0].pack("vvVC4") if dng # DNGVersion 1.4.0.0
+
+      "II*\0".b + [8].pack("V") + [entries].pack("v") + ifd.join + [0].pack("V") + "\x80".b
+    end
+  end
+end
+
+Bench::Corpus.generate if $0 == __FILE__
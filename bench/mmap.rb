@@ -0,0 +1,30 @@
+# Compares opening and reading images through Exiv2's FileIo with reading them through a
+# memory mapping. Run with a directory of images, for example:
+#
+#   ruby -Ilib -Iext bench/mmap.rb ~/Pictures
+#
+# Each pass reads every image once, so run it twice if you want a warm page cache.
+require 'benchmark'
+require 'exiv2'
+
+paths = ARGV.empty? ? Dir["spec/files/*.jpg"] : ARGV.flat_map { |dir| Dir[File.join(dir, "**", "*.{jpg,jpeg,tif,tiff,png,dng,cr2,nef}")] }
+abort "No images to read" if paths.empty?
+passes = Integer(ENV.fetch("PASSES", paths.size < 100 ? 1000 : 1))
+
+def read_all(paths, passes, options)
+  passes.times do
+    paths.each do |path|
+      image = Exiv2::ImageFactory.open(path, **options)
+      image.read_metadata
+      image.exif_data.to_hash
+    end
+  end
+end
+
+read_all(paths, 1, {})
+puts "#{paths.size} images, #{passes} passes"
+
+Benchmark.bm(8) do |bm|
+  bm.report("FileIo") { read_all(paths, passes, {}) }
+  bm.report("mmap") { read_all(paths, passes, mmap: true) }
+end
@@ -0,0 +1,134 @@
+# Benchmarks the main operations of the binding over the images from bench/corpus.rb,
+# measuring ops/sec with benchmark-ips and Ruby allocations per op with memory_profiler.
+# Run it with rake:
+#
+#   rake bench            # Compare with bench/baseline.json, if there is one
+#   rake bench:baseline   # Store the results as the new baseline
+#
+# ONLY=regexp picks out operations or images by label (for example ONLY="to_hash.*large"),
+# and BENCH_TIME sets how many seconds each is run for.
+require 'benchmark/ips'
+require 'json'
+require 'memory_profiler'
+require 'exiv2'
+require_relative 'corpus'
+
+module Bench
+  BASELINE = File.expand_path("baseline.json", __dir__)
+  TIME = Float(ENV.fetch("BENCH_TIME", "2"))
+  ALLOCATION_RUNS = 20
+
+  # Each operation sets up what it needs for an image once, then runs that many times.
+  Operation = Struct.new(:name, :setup, :run)
+
+  def self.read(path)
+    image = Exiv2::ImageFactory.open(path)
+    image.read_metadata
+    image
+  end
+
+  flip = false
+
+  OPERATIONS = [
+    Operation.new("open", ->(path) { path }, ->(path) { Exiv2::ImageFactory.open(path) }),
+    Operation.new("read_metadata", ->(path) { Exiv2::ImageFactory.open(path) }, ->(image) { image.read_metadata }),
+    # The same read and conversion, but keeping only one key. Exiv2 still parses everything,
+    # so the difference between these two is what's saved by not converting the rest.
+    Operation.new("read_metadata+to_hash", ->(path) { Exiv2::ImageFactory.open(path) }, lambda do |image|
+      image.read_metadata
+      image.exif_data.to_hash
+      image.iptc_data.to_hash
+      image.xmp_data.to_hash
+    end),
+    Operation.new("read_metadata(keys:)+to_hash", ->(path) { Exiv2::ImageFactory.open(path) }, lambda do |image|
+      image.read_metadata(keys: ["Exif.Photo.DateTimeOriginal"])
+      image.exif_data.to_hash
+      image.iptc_data.to_hash
+      image.xmp_data.to_hash
+    end),
+    Operation.new("each", method(:read), lambda do |image|
+      image.exif_data.each { |key, value| }
+      image.iptc_data.each { |key, value| }
+      image.xmp_data.each { |key, value| }
+    end),
+    Operation.new("to_hash", method(:read), lambda do |image|
+      image.exif_data.to_hash
+      image.iptc_data.to_hash
+      image.xmp_data.to_hash
+    end),
+    Operation.new("[]", method(:read), lambda do |image|
+      image.exif_data["Exif.Image.Model"]
+      image.iptc_data["Iptc.Application2.Keywords"]
+      image.xmp_data["Xmp.dc.subject"]
+    end),
+    Operation.new("[]=/delete_all", method(:read), lambda do |image|
+      flip = !flip
+      image.iptc_data["Iptc.Application2.Caption"] = flip ? "Flip" : "Flop"
+      image.exif_data.delete_all("Exif.Image.Artist")
+    end),
+    Operation.new("write_metadata", ->(path) { Exiv2::ImageFactory.open_buffer(File.binread(path)).tap(&:read_metadata) }, lambda do |image|
+      flip = !flip
+      image.iptc_data["Iptc.Application2.Caption"] = flip ? "Flip" : "Flop"
+      image.write_metadata(to: String.new)
+    end),
+  ]
+
+  def self.run(store_baseline: false)
+    only = ENV["ONLY"] && Regexp.new(ENV["ONLY"])
+    results = {}
+
+    OPERATIONS.each do |operation|
+      cases = Corpus.paths.map { |path| ["#{operation.name} #{File.basename(path)}", path] }
+      cases.select! { |label, _| label =~ only } if only
+      next if cases.empty?
+
+      states = cases.map { |label, path| [label, operation.setup.call(path)] }
+
+      report = Benchmark.ips do |x|
+        x.config(time: TIME, warmup: TIME / 4)
+        states.each do |label, state|
+          x.report(label) { operation.run.call(state) }
+        end
+      end
+
+      report.entries.each do |entry|
+        results[entry.label] = { "ips" => entry.ips }
+      end
+
+      states.each do |label, state|
+        memory = MemoryProfiler.report { ALLOCATION_RUNS.times { operation.run.call(state) } }
+        results[label]["allocations"] = memory.total_allocated.to_f / ALLOCATION_RUNS
+      end
+    end
+
+    if store_baseline
+      File.write(BASELINE, JSON.pretty_generate(results) + "\n")
+      puts "\nStored the baseline in #{BASELINE}"
+    end
+
+    compare(results, File.exist?(BASELINE) ? JSON.parse(File.read(BASELINE)) : {})
+  end
+
+  def self.compare(results, baseline)
+    width = results.keys.map(&:length).max
+    puts
+    puts "%-#{width}s  %12s  %8s  %12s  %8s" % ["", "ops/sec", "vs base", "allocs/op", "vs base"]
+
+    results.each do |label, result|
+      base = baseline[label] || {}
+      puts "%-#{width}s  %12.1f  %8s  %12.1f  %8s" % [
+        label,
+        result["ips"], ratio(result["ips"], base["ips"]),
+        result["allocations"], ratio(result["allocations"], base["allocations"]),
+      ]
+    end
+
+    puts "\nNo baseline to compare with; run rake bench:baseline to store one." if baseline.empty?
+  end
+
+  def self.ratio(value, base)
+    base && base > 0 ? "%.2fx" % (value / base) : "-"
+  end
+end
+
+Bench.run(store_baseline: ARGV.include?("--baseline")) if $0 == __FILE__
@@ -1,543 +1,4068 @@
 #include "exiv2/image.hpp"
 #include "exiv2/error.hpp"
+#include "exiv2/preview.hpp"
+#include "exiv2/xmp_exiv2.hpp"
 #include "ruby.h"
 #include "ruby/encoding.h"
-
-static const rb_encoding *UTF_8 = rb_enc_find("UTF-8");
+#include "ruby/thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Encodings, classes and method ids used while converting values, looked up once in
+// Init_exiv2 rather than on every call.
+static const rb_encoding *UTF_8;
+static rb_encoding *ISO_8859_1;
+static VALUE date_class;
+static ID id_new;
+static ID id_to_s;
+static ID id_read;
+static ID id_seek;
+static ID id_size;
+static ID id_write;
+static ID id_image;  // @image, which data keep their image in.
+static VALUE sym_total_allocated_objects;
 
 static VALUE to_ruby_string(const std::string& string, const rb_encoding *encoding = UTF_8) {
   return rb_enc_str_new(string.data(), string.length(), encoding);
 }
 
+// Metadata keys come from a small, fixed set of names, so they're returned as frozen,
+// interned strings that are shared between all data (and images) that have them.
+static VALUE to_ruby_key(const std::string& key) {
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str(key.data(), key.length(), UTF_8);
+#else
+  return rb_obj_freeze(to_ruby_string(key));
+#endif
+}
+
+// Create a Ruby hash with room for capa entries, where the Ruby version allows for it.
+static VALUE hash_new_capa(long capa) {
+#ifdef HAVE_RB_HASH_NEW_CAPA
+  return rb_hash_new_capa(capa);
+#else
+  return rb_hash_new();
+#endif
+}
+
 // Create a C++ std::string from a Ruby string.
 static std::string to_std_string(VALUE string) {
   string = StringValue(string); // Convert the Ruby object to a string if it isn't one.
   return std::string(RSTRING_PTR(string), RSTRING_LEN(string));
 }
 
+static bool starts_with(const std::string& string, const char* prefix) {
+  return string.compare(0, strlen(prefix), prefix) == 0;
+}
+
 // Create a C++ std::string from a Ruby object.
 static std::string value_to_std_string(VALUE obj) {
-  VALUE string = rb_funcall(obj, rb_intern("to_s"), 0);
+  VALUE string = rb_funcall(obj, id_to_s, 0);
   return std::string(RSTRING_PTR(string), RSTRING_LEN(string));
 }
 
-// Shared method for implementing each on XmpData, IptcData and ExifData.
+// Thrown through Exiv2 when a Ruby method it ended up calling (for example on the IO an
+// image is read from) raised, so that the Ruby exception can be raised once we've got back
+// out. The exception itself must be kept somewhere the GC can see it in the meantime.
+struct RubyError {
+  VALUE exception; // Or nil if we're unwinding for something other than an exception.
+  int state;
+};
+
+// Whether this thread is in a call to without_gvl, so doesn't have the GVL.
+static thread_local bool gvl_released = false;
+
+// Exiv2 errors caught while the GVL was released, to be raised once we have it back.
 template <class T>
-static VALUE metadata_each(VALUE self, const rb_encoding *encoding = UTF_8) {
-  T* data;
-  Data_Get_Struct(self, T, data);
+struct WithoutGvlCall {
+  void (*work)(T *);
+  T *data;
+  bool ran;
+  bool failed;
+  std::string message;
+  RubyError ruby_error;
+};
 
-  for (typename T::iterator it = data->begin(); it != data->end(); it++) {
-    int n = it->count();
-    if (n == 0) continue;
-
-    const Exiv2::Value &val = it->value();
-
-    VALUE key = to_ruby_string(it->key());
-    VALUE value = 0;
-
-    switch (it->typeId()) {
-      case Exiv2::unsignedByte:
-      case Exiv2::unsignedShort:
-      case Exiv2::unsignedLong:
-      case Exiv2::unsignedLongLong:
-      case Exiv2::tiffIfd:
-      case Exiv2::tiffIfd8: {
-        value = ULL2NUM(val.toLong(0));
-        break;
+template <class T>
+static void *without_gvl_call(void *arg) {
+  WithoutGvlCall<T> *call = static_cast<WithoutGvlCall<T> *>(arg);
+  call->ran = true;
+  gvl_released = true;
+
+  try {
+    call->work(call->data);
+  }
+  catch (RubyError& error) {
+    call->ruby_error = error;
+  }
+  catch (Exiv2::AnyError& error) {
+    call->failed = true;
+    call->message = error.what();
+  }
+  catch (std::exception& error) {
+    call->failed = true;
+    call->message = error.what();
+  }
+
+  gvl_released = false;
+  return NULL;
+}
+
+static VALUE basic_error_class;
+
+// Run a call into Exiv2 without holding the GVL, so other Ruby threads can run (and
+// parse other images) in the meantime. The work function must not touch any Ruby
+// objects, other than through call_with_gvl. Exceptions can't cross back into Ruby from
+// there, so they're caught and re-raised as Exiv2::BasicError after the GVL has been
+// reacquired (or as the original exception, if it came from Ruby).
+//
+// Thread#kill, Timeout and Ctrl-C interrupt the call with RUBY_UBF_IO, which breaks
+// Exiv2 out of reads and writes that can block, like those on pipes and network files.
+// Reading a local file can't be interrupted, so that finishes first. Interrupts are
+// handled once the call's been cleaned up, in case they raise, and if one arrives before
+// the work has started, the work is started again afterwards.
+template <class T>
+static void without_gvl(void (*work)(T *), T *data) {
+  VALUE error = Qnil;
+  RubyError ruby_error = { Qnil, 0 };
+  bool ran = false;
+
+  while (!ran) {
+    {
+      WithoutGvlCall<T> call = { work, data, false, false, std::string(), ruby_error };
+      rb_thread_call_without_gvl2(without_gvl_call<T>, &call, RUBY_UBF_IO, NULL);
+
+      ran = call.ran;
+      if (call.failed)
+        error = rb_exc_new(basic_error_class, call.message.data(), call.message.length());
+      ruby_error = call.ruby_error;
+    }
+
+    rb_thread_check_ints();
+  }
+
+  if (!NIL_P(ruby_error.exception))
+    rb_exc_raise(ruby_error.exception);
+  if (ruby_error.state)
+    rb_jump_tag(ruby_error.state);
+  if (!NIL_P(error))
+    rb_exc_raise(error);
+}
+
+struct CallWithGvl {
+  VALUE (*function)(VALUE);
+  VALUE arg;
+  VALUE errors;
+  VALUE result;
+  VALUE exception;
+  int state;
+};
+
+static void *call_with_gvl_protected(void *arg) {
+  CallWithGvl *call = static_cast<CallWithGvl *>(arg);
+  call->result = rb_protect(call->function, call->arg, &call->state);
+
+  if (call->state) {
+    VALUE exception = rb_errinfo();
+    if (rb_obj_is_kind_of(exception, rb_eException)) {
+      rb_ary_push(call->errors, exception); // Keep it safe from the GC until it's raised.
+      rb_set_errinfo(Qnil);
+      call->exception = exception;
+    }
+  }
+
+  return NULL;
+}
+
+// Call a Ruby function from code that may be running inside without_gvl, taking the GVL
+// back for it if need be. If it raises, the exception is pushed onto the errors array and
+// a RubyError is thrown to carry it back out through Exiv2.
+static VALUE call_with_gvl(VALUE (*function)(VALUE), VALUE arg, VALUE errors) {
+  CallWithGvl call = { function, arg, errors, Qnil, Qnil, 0 };
+
+  if (gvl_released) {
+    gvl_released = false;
+    rb_thread_call_with_gvl(call_with_gvl_protected, &call);
+    gvl_released = true;
+  }
+  else {
+    call_with_gvl_protected(&call);
+  }
+
+  if (call.state) {
+    RubyError error = { call.exception, call.state };
+    throw error;
+  }
+
+  return call.result;
+}
+
+// Opt-in counters of where the time goes, for each phase of working with images. They're
+// updated from whichever thread does the work (including the batch workers), so they're
+// atomic, and while they're off all they cost is checking the flag.
+enum Phase { phase_open, phase_read, phase_convert, phase_write, phase_count };
+
+struct PhaseStats {
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> total_ns;
+  std::atomic<uint64_t> max_ns;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> objects;  // Ruby objects allocated (by any thread) while converting.
+  std::atomic<uint64_t> values;   // Data converted, which is also only counted for converting.
+};
+
+static PhaseStats phase_stats[phase_count];
+static std::atomic<bool> stats_enabled(false);
+
+// Times a phase from when it's created until it goes out of scope, and counts it then.
+// It can be paused, to leave out time that isn't spent on the phase itself.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(Phase phase)
+    : phase_(phase), enabled_(stats_enabled.load(std::memory_order_relaxed)), running_(true),
+      start_(enabled_ ? now() : 0), elapsed_(0), bytes_(0), objects_(0) {}
+  ~PhaseTimer() { stop(); }
+
+  void pause() {
+    if (!enabled_ || !running_) return;
+    elapsed_ += now() - start_;
+    running_ = false;
+  }
+
+  void resume() {
+    if (!enabled_ || running_) return;
+    start_ = now();
+    running_ = true;
+  }
+
+  // Count the phase now, rather than when the timer's destroyed, which a Ruby exception or
+  // break would skip.
+  void stop();
+
+  bool enabled() const { return enabled_; }
+  bool running() const { return enabled_ && running_; }
+  void add_bytes(uint64_t bytes) { bytes_ += bytes; }
+  void add_objects(uint64_t objects) { objects_ += objects; }
+
+private:
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  Phase phase_;
+  bool enabled_;
+  bool running_;
+  uint64_t start_;
+  uint64_t elapsed_;
+  uint64_t bytes_;
+  uint64_t objects_;
+};
+
+void PhaseTimer::stop() {
+  if (!enabled_) return;
+  pause();
+  enabled_ = false;
+
+  uint64_t elapsed = elapsed_;
+  PhaseStats& stats = phase_stats[phase_];
+  stats.calls.fetch_add(1, std::memory_order_relaxed);
+  stats.total_ns.fetch_add(elapsed, std::memory_order_relaxed);
+  stats.bytes.fetch_add(bytes_, std::memory_order_relaxed);
+  stats.objects.fetch_add(objects_, std::memory_order_relaxed);
+
+  uint64_t max = stats.max_ns.load(std::memory_order_relaxed);
+  while (elapsed > max && !stats.max_ns.compare_exchange_weak(max, elapsed, std::memory_order_relaxed)) {}
+}
+
+// The XMP toolkit keeps global state, so it needs a lock once parsing can happen on
+// several threads at the same time.
+static std::mutex xmp_mutex;
+
+static void xmp_lock(void *data, bool lock) {
+  std::mutex *mutex = static_cast<std::mutex *>(data);
+
+  if (lock)
+    mutex->lock();
+  else
+    mutex->unlock();
+}
+
+// An image that a batch has finished with, or the error from trying to get it.
+struct BatchItem {
+  BatchItem() : index(0), image(NULL), changed(false), failed(false) {}
+
+  size_t index;
+  Exiv2::Image* image;
+  bool changed; // Whether the image was written, for write_many.
+  bool failed;
+  std::string error;
+};
+
+// Opens and processes a list of images on a pool of native threads, for the batch methods
+// on the Exiv2 module. Finished items queue up (a limited number at a time) for the Ruby
+// thread running the batch, which picks them up in the order they finish, and waits for
+// them without holding the GVL.
+class Batch {
+public:
+  // Processes a single path on a worker thread, setting the item's image if the Ruby
+  // thread should see it. Exiv2 errors are caught and stored in the item.
+  typedef void (*Process)(BatchItem& item, const std::string& path, void* context);
+
+  Batch(Process process, void* context)
+    : process_(process), context_(context), limit_(0), started_(0), delivered_(0), cancelled_(false), interrupted_(false) {}
+  ~Batch();
+
+  void add(const std::string& path) { paths_.push_back(path); }
+  size_t size() const { return paths_.size(); }
+
+  // Start working on the paths that have been added; returns false if no threads could be started.
+  bool start(size_t threads);
+
+  // Wait for the next finished item, freeing the image of the previous one. Returns false
+  // when there are no more.
+  bool next();
+  BatchItem& current() { return current_; }
+
+private:
+  void work();
+  static void* wait(void* batch);
+  static void interrupt(void* batch);
+  static void* join(void* batch);
+
+  Process process_;
+  void* context_;
+  std::vector<std::string> paths_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable workers_cv_;
+  std::condition_variable finished_cv_;
+  std::deque<BatchItem> finished_;
+  size_t limit_;      // How many finished items can queue up before the workers wait.
+  size_t started_;    // How many paths the workers have picked up.
+  size_t delivered_;  // How many finished items next() has handed out.
+  bool cancelled_;
+  bool interrupted_;
+
+  BatchItem current_;
+};
+
+Batch::~Batch() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+  }
+  workers_cv_.notify_all();
+
+  rb_thread_call_without_gvl(join, this, NULL, NULL);
+
+  for (std::deque<BatchItem>::iterator it = finished_.begin(); it != finished_.end(); it++)
+    delete it->image;
+  delete current_.image;
+}
+
+bool Batch::start(size_t threads) {
+  if (threads > paths_.size()) threads = paths_.size();
+  if (threads < 1) threads = 1;
+  limit_ = threads * 2;
+
+  try {
+    for (size_t i = 0; i < threads; i++)
+      workers_.push_back(std::thread(&Batch::work, this));
+  }
+  catch (std::system_error&) {
+    // Carry on with the threads we've got, if there are any.
+  }
+
+  return !workers_.empty();
+}
+
+bool Batch::next() {
+  delete current_.image;
+  current_ = BatchItem();
+
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      if (!finished_.empty()) {
+        current_ = finished_.front();
+        finished_.pop_front();
+        delivered_++;
+        workers_cv_.notify_one();
+        return true;
       }
 
-      case Exiv2::signedByte:
-      case Exiv2::signedShort:
-      case Exiv2::signedLong:
-      case Exiv2::signedLongLong: {
-        value = LL2NUM(val.toLong(0));
-        break;
+      if (delivered_ == paths_.size()) return false;
+      interrupted_ = false;
+    }
+
+    rb_thread_call_without_gvl(wait, this, interrupt, this);
+    rb_thread_check_ints(); // Raises if the thread was woken up to be killed, or for an exception.
+  }
+}
+
+void Batch::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  for (;;) {
+    while (!cancelled_ && started_ < paths_.size() && finished_.size() >= limit_)
+      workers_cv_.wait(lock);
+    if (cancelled_ || started_ == paths_.size()) return;
+
+    BatchItem item;
+    item.index = started_++;
+    lock.unlock();
+
+    try {
+      process_(item, paths_[item.index], context_);
+    }
+    catch (Exiv2::AnyError& error) {
+      item.failed = true;
+      item.error = error.what();
+    }
+    catch (std::exception& error) {
+      item.failed = true;
+      item.error = error.what();
+    }
+
+    if (item.failed) {
+      delete item.image;
+      item.image = NULL;
+    }
+
+    lock.lock();
+    finished_.push_back(item);
+    finished_cv_.notify_one();
+  }
+}
+
+void* Batch::wait(void* arg) {
+  Batch* batch = static_cast<Batch*>(arg);
+  std::unique_lock<std::mutex> lock(batch->mutex_);
+
+  while (batch->finished_.empty() && !batch->interrupted_)
+    batch->finished_cv_.wait(lock);
+
+  return NULL;
+}
+
+void Batch::interrupt(void* arg) {
+  Batch* batch = static_cast<Batch*>(arg);
+  std::lock_guard<std::mutex> lock(batch->mutex_);
+
+  batch->interrupted_ = true;
+  batch->finished_cv_.notify_all();
+}
+
+void* Batch::join(void* arg) {
+  Batch* batch = static_cast<Batch*>(arg);
+
+  for (std::vector<std::thread>::iterator it = batch->workers_.begin(); it != batch->workers_.end(); it++)
+    it->join();
+
+  return NULL;
+}
+
+// Days since 1970-01-01 for a date in the proleptic Gregorian calendar.
+static long days_from_civil(long year, long month, long day) {
+  year -= month <= 2;
+  long era = (year >= 0 ? year : year - 399) / 400;
+  long year_of_era = year - era * 400;
+  long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+// Build a Date straight from the components of an Exiv2 date, rather than formatting it
+// as a string and parsing that again in Ruby.
+static VALUE date_to_ruby(const Exiv2::DateValue& value) {
+  const Exiv2::DateValue::Date& date = value.getDate();
+  return rb_funcall(date_class, id_new, 3, INT2NUM(date.year), INT2NUM(date.month), INT2NUM(date.day));
+}
+
+// Build a Time straight from the components of an Exiv2 time. Exiv2 times don't have a
+// date, so like Time.parse, this uses today's.
+static VALUE time_to_ruby(const Exiv2::TimeValue& value) {
+  const Exiv2::TimeValue::Time& time = value.getTime();
+  int offset = time.tzHour * 3600 + time.tzMinute * 60;
+
+  time_t now = std::time(NULL);
+  struct tm today;
+  localtime_r(&now, &today);
+
+  struct timespec timespec;
+  timespec.tv_sec = days_from_civil(today.tm_year + 1900, today.tm_mon + 1, today.tm_mday) * 86400
+                  + time.hour * 3600 + time.minute * 60 + time.second - offset;
+  timespec.tv_nsec = 0;
+
+  return rb_time_timespec_new(&timespec, offset);
+}
+
+// A single component of a numeric value as a Ruby object.
+static VALUE component_to_ruby(uint16_t component) { return UINT2NUM(component); }
+static VALUE component_to_ruby(uint32_t component) { return UINT2NUM(component); }
+static VALUE component_to_ruby(int16_t component) { return INT2NUM(component); }
+static VALUE component_to_ruby(int32_t component) { return INT2NUM(component); }
+static VALUE component_to_ruby(float component) { return rb_float_new(component); }
+static VALUE component_to_ruby(double component) { return rb_float_new(component); }
+
+static VALUE component_to_ruby(const Exiv2::URational& component) {
+  return rb_rational_new(UINT2NUM(component.first), UINT2NUM(component.second));
+}
+
+static VALUE component_to_ruby(const Exiv2::Rational& component) {
+  return rb_rational_new(INT2NUM(component.first), INT2NUM(component.second));
+}
+
+// Convert a numeric value straight from its ValueType storage: the component itself if it
+// only has one, otherwise an array of all of them. Returns 0 if the value isn't stored as
+// a ValueType<T>, so the caller can fall back to the generic accessors.
+template <class T>
+static VALUE components_to_ruby(const Exiv2::Value& val) {
+  const Exiv2::ValueType<T>* typed = dynamic_cast<const Exiv2::ValueType<T>*>(&val);
+  if (!typed || typed->value_.empty()) return 0;
+
+  if (typed->value_.size() == 1)
+    return component_to_ruby(typed->value_.front());
+
+  VALUE result = rb_ary_new_capa(typed->value_.size());
+  for (typename Exiv2::ValueType<T>::ValueList::const_iterator it = typed->value_.begin(); it != typed->value_.end(); it++)
+    rb_ary_push(result, component_to_ruby(*it));
+
+  return result;
+}
+
+// Convert the components of an integer value through toLong, for values that aren't
+// stored as a ValueType (bytes are kept in a DataValue).
+static VALUE integers_to_ruby(const Exiv2::Value& val, int n, bool is_signed) {
+  if (n == 1)
+    return is_signed ? LL2NUM(val.toLong(0)) : ULL2NUM(val.toLong(0));
+
+  VALUE result = rb_ary_new_capa(n);
+  for (int i = 0; i < n; i++)
+    rb_ary_push(result, is_signed ? LL2NUM(val.toLong(i)) : ULL2NUM(val.toLong(i)));
+
+  return result;
+}
+
+// The bytes of a value exactly as Exiv2 stores them, as a binary string.
+static VALUE raw_to_ruby(const Exiv2::Value& val) {
+  VALUE result = rb_str_new(NULL, val.size());
+  val.copy(reinterpret_cast<Exiv2::byte*>(RSTRING_PTR(result)), Exiv2::invalidByteOrder);
+  return result;
+}
+
+// Convert the value of an Exifdatum, Iptcdatum or Xmpdatum to a Ruby object. Returns 0
+// for data without any values, which are skipped. Numeric values with more than one
+// component are returned as arrays. With raw, undefined and byte values are returned as
+// binary strings of their bytes rather than being formatted.
+static VALUE convert_metadatum(const Exiv2::Metadatum& datum, const rb_encoding *encoding, bool raw) {
+  int n = datum.count();
+  if (n == 0) return 0;
+
+  const Exiv2::Value &val = datum.value();
+  VALUE value = 0;
+
+  switch (datum.typeId()) {
+    case Exiv2::unsignedByte:
+    case Exiv2::signedByte: {
+      value = raw ? raw_to_ruby(val) : integers_to_ruby(val, n, datum.typeId() == Exiv2::signedByte);
+      break;
+    }
+
+    case Exiv2::unsignedShort: {
+      value = components_to_ruby<uint16_t>(val);
+      break;
+    }
+
+    case Exiv2::unsignedLong:
+    case Exiv2::tiffIfd: {
+      value = components_to_ruby<uint32_t>(val);
+      break;
+    }
+
+    case Exiv2::signedShort: {
+      value = components_to_ruby<int16_t>(val);
+      break;
+    }
+
+    case Exiv2::signedLong: {
+      value = components_to_ruby<int32_t>(val);
+      break;
+    }
+
+    case Exiv2::tiffFloat: {
+      value = components_to_ruby<float>(val);
+      break;
+    }
+
+    case Exiv2::tiffDouble: {
+      value = components_to_ruby<double>(val);
+      break;
+    }
+
+    case Exiv2::unsignedRational: {
+      value = components_to_ruby<Exiv2::URational>(val);
+      break;
+    }
+
+    case Exiv2::signedRational: {
+      value = components_to_ruby<Exiv2::Rational>(val);
+      break;
+    }
+
+    case Exiv2::date: {
+      value = date_to_ruby(static_cast<const Exiv2::DateValue &>(val));
+      break;
+    }
+
+    case Exiv2::time: {
+      value = time_to_ruby(static_cast<const Exiv2::TimeValue &>(val));
+      break;
+    }
+
+    // TODO: this doesn't roundtrip yet
+    case Exiv2::langAlt: {
+      Exiv2::LangAltValue::ValueType values = static_cast<const Exiv2::LangAltValue &>(val).value_;
+      Exiv2::LangAltValue::ValueType::iterator first = values.begin();
+
+      if (n == 1 && first->first == "x-default") {
+        value = to_ruby_string(first->second, encoding);
+      } else {
+        value = hash_new_capa(n);
+
+        for (Exiv2::LangAltValue::ValueType::iterator itv = values.begin(); itv != values.end(); itv++) {
+          VALUE lang = to_ruby_string(itv->first, encoding);
+          VALUE item = to_ruby_string(itv->second, encoding);
+          rb_hash_aset(value, lang, item);
+        }
+      }
+      break;
+   }
+
+    case Exiv2::xmpBag:
+    case Exiv2::xmpSeq: {
+      value = rb_ary_new_capa(n);
+
+      for (int i = 0; i < n; i++) {
+        VALUE item = to_ruby_string(val.toString(i), encoding);
+        rb_ary_push(value, item);
+      }
+      break;
+    }
+
+    case Exiv2::undefined: {
+      value = raw ? raw_to_ruby(val) : to_ruby_string(val.toString(), encoding);
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  if (value)
+    return value;
+
+  // Any other numeric types (and numeric values Exiv2 stores some other way) go through
+  // the generic accessors.
+  switch (datum.typeId()) {
+    case Exiv2::unsignedShort:
+    case Exiv2::unsignedLong:
+    case Exiv2::unsignedLongLong:
+    case Exiv2::tiffIfd:
+    case Exiv2::tiffIfd8:
+      return integers_to_ruby(val, n, false);
+
+    case Exiv2::signedShort:
+    case Exiv2::signedLong:
+    case Exiv2::signedLongLong:
+      return integers_to_ruby(val, n, true);
+
+    case Exiv2::tiffFloat:
+    case Exiv2::tiffDouble: {
+      if (n == 1) return rb_float_new((double) val.toFloat(0));
+
+      value = rb_ary_new_capa(n);
+      for (int i = 0; i < n; i++)
+        rb_ary_push(value, rb_float_new((double) val.toFloat(i)));
+      return value;
+    }
+
+    case Exiv2::unsignedRational:
+    case Exiv2::signedRational: {
+      bool is_signed = datum.typeId() == Exiv2::signedRational;
+      value = rb_ary_new_capa(n);
+
+      for (int i = 0; i < n; i++) {
+        Exiv2::Rational rational = val.toRational(i);
+        rb_ary_push(value, is_signed ? component_to_ruby(rational)
+                                     : component_to_ruby(Exiv2::URational(rational.first, rational.second)));
       }
+      return n == 1 ? rb_ary_entry(value, 0) : value;
+    }
+
+    default:
+      return to_ruby_string(val.toString(0), encoding);
+  }
+}
+
+// Times a whole call that converts data to Ruby (each, to_hash, [] and so on) as a convert
+// phase, along with the Ruby objects allocated meanwhile, rather than timing each datum,
+// which would cost more than converting most of them. each pauses it while its block
+// runs. The GC only counts objects for the whole process, so those allocated by other
+// threads at the same time are counted too.
+class ConvertTimer {
+public:
+  ConvertTimer() : timer_(phase_convert), allocated_(timer_.enabled() ? rb_gc_stat(sym_total_allocated_objects) : 0) {}
+  ~ConvertTimer() { stop(); }
+
+  void pause() {
+    if (!timer_.running()) return;
+    timer_.add_objects(rb_gc_stat(sym_total_allocated_objects) - allocated_);
+    timer_.pause();
+  }
+
+  void resume() {
+    if (!timer_.enabled() || timer_.running()) return;
+    allocated_ = rb_gc_stat(sym_total_allocated_objects);
+    timer_.resume();
+  }
+
+  void stop() {
+    pause();
+    timer_.stop();
+  }
+
+private:
+  PhaseTimer timer_;
+  size_t allocated_;
+};
+
+// Convert a value with convert_metadatum, counting it (and its size) when stats are on.
+static VALUE metadatum_to_ruby(const Exiv2::Metadatum& datum, const rb_encoding *encoding, bool raw = false) {
+  if (stats_enabled.load(std::memory_order_relaxed)) {
+    PhaseStats& stats = phase_stats[phase_convert];
+    stats.values.fetch_add(1, std::memory_order_relaxed);
+    stats.bytes.fetch_add(datum.size(), std::memory_order_relaxed);
+  }
+
+  return convert_metadatum(datum, encoding, raw);
+}
+
+// The Ruby objects wrapping an image's Exif, IPTC and XMP data don't own them. The image
+// does, and they keep it alive with @image. Data decoded from blobs belong to their
+// objects, and have types of their own (with the borrowed types as parents, so both can
+// be used wherever data are expected).
+template <class T>
+static void metadata_free(void* data) {
+  delete static_cast<T*>(data);
+}
+
+// Roughly how much memory some data take up in Exiv2.
+template <class T>
+static size_t metadata_memsize(const T& data) {
+  size_t size = 0;
+  for (typename T::const_iterator it = data.begin(); it != data.end(); it++)
+    size += sizeof(*it) + it->size() + 64; // 64 for the key and the value object.
+  return size;
+}
+
+template <class T>
+static size_t metadata_memsize(const void* data) {
+  return sizeof(T) + metadata_memsize(*static_cast<const T*>(data));
+}
+
+static const rb_data_type_t exif_data_type = {
+  "Exiv2::ExifData", { 0, 0, 0 }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+static const rb_data_type_t own_exif_data_type = {
+  "Exiv2::ExifData", { 0, metadata_free<Exiv2::ExifData>, metadata_memsize<Exiv2::ExifData> }, &exif_data_type, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+static const rb_data_type_t iptc_data_type = {
+  "Exiv2::IptcData", { 0, 0, 0 }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+static const rb_data_type_t own_iptc_data_type = {
+  "Exiv2::IptcData", { 0, metadata_free<Exiv2::IptcData>, metadata_memsize<Exiv2::IptcData> }, &iptc_data_type, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+static const rb_data_type_t xmp_data_type = {
+  "Exiv2::XmpData", { 0, 0, 0 }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+template <class T> static const rb_data_type_t* data_type();
+template <> const rb_data_type_t* data_type<Exiv2::ExifData>() { return &exif_data_type; }
+template <> const rb_data_type_t* data_type<Exiv2::IptcData>() { return &iptc_data_type; }
+template <> const rb_data_type_t* data_type<Exiv2::XmpData>() { return &xmp_data_type; }
+
+static bool image_is_closed(VALUE self);
+static void image_pin(VALUE self);
+static VALUE image_unpin(VALUE self);
+
+// Get the data wrapped by a Ruby object, checking the image they belong to (if any)
+// hasn't been closed.
+template <class T>
+static T* get_data(VALUE self) {
+  T* data = static_cast<T*>(rb_check_typeddata(self, data_type<T>()));
+
+  VALUE image = rb_ivar_get(self, id_image);
+  if (!NIL_P(image) && image_is_closed(image)) rb_raise(rb_eIOError, "closed image");
+
+  return data;
+}
+
+// Run body with the image the data belong to (if any) pinned, so it can't be closed
+// while body is using the data, even if it yields or lets other threads run.
+static VALUE with_data_pinned(VALUE self, VALUE (*body)(VALUE), VALUE arg) {
+  VALUE image = rb_ivar_get(self, id_image);
+  if (NIL_P(image)) return body(arg);
+
+  image_pin(image);
+  return rb_ensure(body, arg, image_unpin, image);
+}
+
+template <class T>
+struct EachCall {
+  VALUE self;
+  const rb_encoding* encoding;
+  bool raw;
+  ConvertTimer* timer;
+};
+
+template <class T>
+static VALUE metadata_each_yield(VALUE arg) {
+  EachCall<T>* call = reinterpret_cast<EachCall<T>*>(arg);
+  T* data = get_data<T>(call->self);
+
+  for (typename T::iterator it = data->begin(); it != data->end(); it++) {
+    VALUE value = metadatum_to_ruby(*it, call->encoding, call->raw);
+
+    if (value) {
+      VALUE pair = rb_ary_new3(2, to_ruby_key(it->key()), value);
+      call->timer->pause();
+      rb_yield(pair);
+      call->timer->resume();
+      get_data<T>(call->self); // The block can't have closed the image, but make sure.
+    }
+  }
+
+  return Qnil;
+}
+
+template <class T>
+static VALUE metadata_each_done(VALUE arg) {
+  reinterpret_cast<EachCall<T>*>(arg)->timer->stop();
+  return Qnil;
+}
+
+template <class T>
+static VALUE metadata_each_timed(VALUE arg) {
+  return rb_ensure(metadata_each_yield<T>, arg, metadata_each_done<T>, arg);
+}
+
+// Shared method for implementing each on XmpData, IptcData and ExifData. The image is
+// pinned while the block runs, so closing it from there raises. The call is timed however
+// it ends, leaving out the time spent in the block.
+template <class T>
+static VALUE metadata_each(VALUE self, const rb_encoding *encoding = UTF_8, bool raw = false) {
+  ConvertTimer timer;
+  EachCall<T> call = { self, encoding, raw, &timer };
+  return with_data_pinned(self, metadata_each_timed<T>, reinterpret_cast<VALUE>(&call));
+}
+
+// Add a value to what's already been found for a key, grouping repeated keys into an
+// array the same way to_hash does.
+static VALUE group_value(VALUE existing, VALUE value) {
+  if (NIL_P(existing))
+    return value;
+
+  if (RB_TYPE_P(existing, T_ARRAY)) {
+    rb_ary_push(existing, value);
+    return existing;
+  }
+
+  return rb_ary_new3(2, existing, value);
+}
+
+// Add all the data to a hash, grouping repeated keys into an array of all their values.
+template <class T>
+static void metadata_fill_hash(T& data, VALUE hash, const rb_encoding *encoding, bool raw = false) {
+  for (typename T::iterator it = data.begin(); it != data.end(); it++) {
+    VALUE value = metadatum_to_ruby(*it, encoding, raw);
+    if (!value) continue;
+
+    VALUE key = to_ruby_key(it->key());
+    rb_hash_aset(hash, key, group_value(rb_hash_lookup(hash, key), value));
+  }
+}
+
+// Shared method for implementing to_hash on XmpData, IptcData and ExifData.
+template <class T>
+static VALUE metadata_to_hash(VALUE self, const rb_encoding *encoding = UTF_8, bool raw = false) {
+  T* data = get_data<T>(self);
+
+  ConvertTimer timer;
+  VALUE result = hash_new_capa(data->count());
+  metadata_fill_hash(*data, result, encoding, raw);
+
+  return result;
+}
+
+// Whether a datum has the given key. Exif and IPTC keys compare their numeric ids, which
+// saves building a key string for every datum.
+static bool key_matches(const Exiv2::Exifdatum& datum, const Exiv2::ExifKey& key) {
+  return datum.tag() == key.tag() && datum.ifdId() == key.ifdId();
+}
+
+static bool key_matches(const Exiv2::Iptcdatum& datum, const Exiv2::IptcKey& key) {
+  return datum.tag() == key.tag() && datum.record() == key.record();
+}
+
+static bool key_matches(const Exiv2::Xmpdatum& datum, const Exiv2::XmpKey& key) {
+  return datum.key() == key.key();
+}
+
+// Look up keys in a single pass over the data, and only convert the values that match.
+// Each key's value is stored in values at the key's index, grouped the same way as to_hash.
+template <class T, class K>
+static void metadata_lookup(T& data, const std::vector<K>& keys, const std::vector<long>& indexes, VALUE values, const rb_encoding *encoding) {
+  if (keys.empty()) return;
+
+  for (typename T::iterator it = data.begin(); it != data.end(); it++) {
+    for (size_t k = 0; k < keys.size(); k++) {
+      if (!key_matches(*it, keys[k])) continue;
+
+      VALUE value = metadatum_to_ruby(*it, encoding);
+      if (value)
+        rb_ary_store(values, indexes[k], group_value(rb_ary_entry(values, indexes[k]), value));
+    }
+  }
+}
+
+// The type add gives the values of new data with a key.
+static Exiv2::TypeId default_type(const Exiv2::ExifKey& key) {
+#if EXIV2_MAJOR_VERSION <= 0 && EXIV2_MINOR_VERSION <= 20
+  return Exiv2::ExifTags::tagType(key.tag(), key.ifdId());
+#else
+  return key.defaultTypeId();
+#endif
+}
+
+static Exiv2::TypeId default_type(const Exiv2::IptcKey& key) {
+  return Exiv2::IptcDataSets::dataSetType(key.tag(), key.record());
+}
+
+static Exiv2::TypeId default_type(const Exiv2::XmpKey& key) {
+  return Exiv2::XmpProperties::propertyType(key);
+}
+
+template <class K>
+struct ParsedKey {
+  K key;
+  Exiv2::TypeId type;
+};
+
+// Parse a key from its name, finding its default type. Both mean searching Exiv2's tag
+// tables, and the same few keys get used over and over, so parsed keys are kept in a
+// cache shared by every thread. Invalid names throw, and aren't cached. The cache stops
+// growing at a few thousand keys, in case something's making up names as it goes.
+template <class K>
+static ParsedKey<K> parse_key(const std::string& name) {
+  static std::mutex mutex;
+  static std::unordered_map<std::string, ParsedKey<K> > keys;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    typename std::unordered_map<std::string, ParsedKey<K> >::const_iterator found = keys.find(name);
+    if (found != keys.end()) return found->second;
+  }
+
+  K key(name);
+  ParsedKey<K> parsed = { key, default_type(key) };
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (keys.size() < 4096) keys.insert(std::make_pair(name, parsed));
+  return parsed;
+}
+
+// parse_key for methods given a single key as a Ruby object, which raise Exiv2::BasicError
+// if it isn't valid rather than letting Exiv2's exception out into Ruby.
+template <class K>
+static ParsedKey<K> parse_key_arg(VALUE key) {
+  VALUE error;
+
+  {
+    std::string name = to_std_string(key);
+
+    try {
+      return parse_key<K>(name);
+    }
+    catch (Exiv2::AnyError& exiv2_error) {
+      error = rb_exc_new_cstr(basic_error_class, exiv2_error.what()); // Raised once name has been freed.
+    }
+  }
+
+  rb_exc_raise(error);
+}
+
+// The value add gives a new datum with the key, as read from a string.
+template <class K>
+static Exiv2::Value::AutoPtr new_value(const ParsedKey<K>& key, const std::string& string) {
+  Exiv2::Value::AutoPtr value = Exiv2::Value::create(key.type);
+  value->read(string);
+  return value;
+}
+
+typedef std::vector<std::unique_ptr<Exiv2::Value> > Values;
+
+// The values []= gives a key, as read from strings. Exif and IPTC keys get a datum (and so
+// a value) per string, but an XMP key gets a single datum whose value holds them all, the
+// way add builds one up when a key's given more than one, like the items of an array.
+template <class K>
+static Values new_values(const ParsedKey<K>& key, const std::vector<std::string>& strings) {
+  Values values;
+  for (size_t i = 0; i < strings.size(); i++)
+    values.push_back(std::unique_ptr<Exiv2::Value>(new_value(key, strings[i]).release()));
+  return values;
+}
+
+template <>
+Values new_values(const ParsedKey<Exiv2::XmpKey>& key, const std::vector<std::string>& strings) {
+  Values values;
+  if (strings.empty()) return values;
+
+  values.push_back(std::unique_ptr<Exiv2::Value>(new_value(key, strings[0]).release()));
+  for (size_t i = 1; i < strings.size(); i++)
+    values.back()->read(strings[i]);
+  return values;
+}
+
+// Shared method for implementing values_at on XmpData, IptcData and ExifData.
+template <class T, class K>
+static VALUE metadata_values_at(VALUE self, int argc, VALUE *argv, const rb_encoding *encoding = UTF_8) {
+  T* data = get_data<T>(self);
+
+  VALUE result = rb_ary_new_capa(argc);
+  std::vector<K> keys;
+  std::vector<long> indexes;
+
+  for (int i = 0; i < argc; i++) {
+    rb_ary_push(result, Qnil);
+
+    try {
+      keys.push_back(parse_key<K>(to_std_string(argv[i])).key);
+      indexes.push_back(i);
+    }
+    catch (Exiv2::AnyError&) {
+      // Not a valid key, so there's nothing to find.
+    }
+  }
+
+  ConvertTimer timer;
+  metadata_lookup(*data, keys, indexes, result, encoding);
+
+  return result;
+}
+
+// Remove every datum matching a predicate in a single pass. IptcData and XmpData keep their
+// data in vectors, so the data being kept are moved up over the deleted ones, and the
+// leftovers are trimmed from the end, rather than erasing from the middle one at a time.
+template <class T, class Predicate>
+static long metadata_erase_if(T& data, Predicate predicate) {
+  typename T::iterator keep = data.begin();
+
+  for (typename T::iterator it = data.begin(); it != data.end(); it++) {
+    if (predicate(*it)) continue;
+    if (keep != it) *keep = *it;
+    keep++;
+  }
+
+  long removed = data.end() - keep;
+  while (data.end() != keep) data.erase(data.end() - 1);
+
+  return removed;
+}
+
+// ExifData keeps its data in a list, so they can be erased where they are.
+template <class Predicate>
+static long metadata_erase_if(Exiv2::ExifData& data, Predicate predicate) {
+  long removed = 0;
+
+  for (Exiv2::ExifData::iterator it = data.begin(); it != data.end();) {
+    if (predicate(*it)) {
+      it = data.erase(it);
+      removed++;
+    }
+    else {
+      it++;
+    }
+  }
+
+  return removed;
+}
+
+// Predicates for metadata_erase_if, matching data with a key, or without any of a list of keys.
+template <class K>
+struct HasKey {
+  const K& key;
+
+  template <class D>
+  bool operator()(const D& datum) const { return key_matches(datum, key); }
+};
+
+template <class K>
+struct HasNoneOfKeys {
+  const std::vector<K>& keys;
+
+  template <class D>
+  bool operator()(const D& datum) const {
+    for (size_t k = 0; k < keys.size(); k++) {
+      if (key_matches(datum, keys[k])) return false;
+    }
+    return true;
+  }
+};
+
+// Remove every datum with the given key.
+template <class T, class K>
+static long metadata_erase_all(T& data, const K& key) {
+  HasKey<K> predicate = { key };
+  return metadata_erase_if(data, predicate);
+}
+
+// Note that an image's metadata has changed since it was last read or written.
+static void image_changed(VALUE image) {
+  rb_iv_set(image, "@dirty", Qtrue);
+}
+
+// Note that some metadata has changed, and with it the image it belongs to.
+static void metadata_changed(VALUE self) {
+  VALUE image = rb_ivar_get(self, id_image);
+  if (!NIL_P(image)) image_changed(image);
+}
+
+// Shared method for implementing _unchanged? on XmpData, IptcData and ExifData, which
+// tells []= whether the data already has exactly the values it would be setting, of the
+// same types, so it can leave them (and the image) alone.
+template <class T, class K>
+static VALUE metadata_unchanged(VALUE self, VALUE key, VALUE values) {
+  T* data = get_data<T>(self);
+
+  values = rb_Array(values);
+  std::vector<std::string> strings;
+  for (long i = 0; i < RARRAY_LEN(values); i++)
+    strings.push_back(value_to_std_string(rb_ary_entry(values, i)));
+
+  std::string name = to_std_string(key);
+  bool unchanged = true;
+  size_t matched = 0;
+  size_t expected = 0;
+
+  try {
+    ParsedKey<K> datum_key = parse_key<K>(name);
+    Values new_data = new_values(datum_key, strings);
+    expected = new_data.size();
+
+    for (typename T::iterator it = data->begin(); unchanged && it != data->end(); it++) {
+      if (!key_matches(*it, datum_key.key)) continue;
+      if (matched == expected) {
+        unchanged = false;
+        break;
+      }
+
+      const Exiv2::Value& value = *new_data[matched++];
+      unchanged = value.typeId() == it->typeId() && value.toString() == it->toString();
+    }
+  }
+  catch (Exiv2::AnyError& error) {
+    rb_raise(basic_error_class, "%s", error.what());
+  }
+
+  return unchanged && matched == expected ? Qtrue : Qfalse;
+}
+
+// The keys being replaced by update, with the new values for each. Once it's been parsed,
+// an update is only read, so one can be applied to many images at the same time.
+template <class K>
+struct Update {
+  std::vector<ParsedKey<K> > keys;
+  std::vector<Values> values; // From new_values.
+  std::unordered_map<std::string, size_t> indexes; // Of each key in keys, by name.
+};
+
+// Predicate for metadata_erase_if, matching data whose values update is replacing.
+template <class K>
+struct IsReplaced {
+  const Update<K>& update;
+  const std::vector<bool>& changed;
+
+  template <class D>
+  bool operator()(const D& datum) const {
+    typename std::unordered_map<std::string, size_t>::const_iterator index = update.indexes.find(datum.key());
+    return index != update.indexes.end() && changed[index->second];
+  }
+};
+
+// Convert a hash of keys and values to an array of [name, [value strings]] pairs, with
+// nil becoming no values. Everything's converted up front, so nothing in Ruby can raise
+// past the C++ that parses them.
+static VALUE update_pairs(VALUE hash) {
+  VALUE pairs = rb_funcall(rb_convert_type(hash, T_HASH, "Hash", "to_hash"), rb_intern("to_a"), 0);
+
+  for (long i = 0; i < RARRAY_LEN(pairs); i++) {
+    VALUE pair = rb_ary_entry(pairs, i);
+    VALUE value = rb_ary_entry(pair, 1);
+    VALUE values = NIL_P(value) ? rb_ary_new() : RB_TYPE_P(value, T_ARRAY) ? rb_ary_dup(value) : rb_ary_new_from_args(1, value);
+
+    for (long v = 0; v < RARRAY_LEN(values); v++)
+      rb_ary_store(values, v, rb_funcall(rb_ary_entry(values, v), id_to_s, 0));
+    VALUE name = rb_ary_entry(pair, 0);
+    rb_ary_store(pair, 0, StringValue(name));
+    rb_ary_store(pair, 1, values);
+  }
+
+  return pairs;
+}
+
+// Parse the keys and values from update_pairs. Invalid keys and values throw.
+template <class K>
+static void update_parse(VALUE pairs, Update<K>& update) {
+  for (long i = 0; i < RARRAY_LEN(pairs); i++) {
+    VALUE pair = rb_ary_entry(pairs, i);
+    VALUE name = rb_ary_entry(pair, 0);
+    VALUE strings = rb_ary_entry(pair, 1);
+
+    std::vector<std::string> values;
+    for (long v = 0; v < RARRAY_LEN(strings); v++) {
+      VALUE string = rb_ary_entry(strings, v);
+      values.push_back(std::string(RSTRING_PTR(string), RSTRING_LEN(string)));
+    }
+
+    ParsedKey<K> key = parse_key<K>(std::string(RSTRING_PTR(name), RSTRING_LEN(name)));
+    update.indexes[key.key.key()] = update.keys.size();
+    update.keys.push_back(key);
+    update.values.push_back(new_values(key, values));
+  }
+}
+
+// Apply an update to some data. The data is swept once to find which keys really change
+// and once more to remove their old values, so it takes O(n + k) rather than k calls to
+// []=. Returns whether anything changed. Doesn't need the GVL.
+template <class T, class K>
+static bool update_apply(T& data, const Update<K>& update) {
+  std::vector<bool> changed(update.keys.size(), false);
+  bool any_changed = false;
+
+  // Find the keys that are actually changing.
+  std::vector<size_t> matched(update.keys.size(), 0);
+  for (typename T::iterator it = data.begin(); it != data.end(); it++) {
+    typename std::unordered_map<std::string, size_t>::const_iterator index = update.indexes.find(it->key());
+    if (index == update.indexes.end()) continue;
+
+    size_t k = index->second;
+    size_t m = matched[k]++;
+    if (m >= update.values[k].size() || update.values[k][m]->typeId() != it->typeId() || update.values[k][m]->toString() != it->toString())
+      changed[k] = true;
+  }
+  for (size_t k = 0; k < update.keys.size(); k++) {
+    if (matched[k] != update.values[k].size()) changed[k] = true;
+    any_changed = any_changed || changed[k];
+  }
+
+  if (!any_changed) return false;
+
+  IsReplaced<K> predicate = { update, changed };
+  metadata_erase_if(data, predicate);
+
+  for (size_t k = 0; k < update.keys.size(); k++) {
+    if (!changed[k]) continue;
+    for (size_t v = 0; v < update.values[k].size(); v++)
+      data.add(update.keys[k].key, update.values[k][v].get());
+  }
+
+  return true;
+}
+
+// Shared method for implementing update on XmpData, IptcData and ExifData. Replaces the
+// values of all the keys in a hash at once, with a value of nil removing the key. Keys
+// and values are parsed once, then applied with update_apply.
+template <class T, class K>
+static VALUE metadata_update(VALUE self, VALUE hash) {
+  T* data = get_data<T>(self);
+  VALUE pairs = update_pairs(hash);
+
+  bool changed = false;
+  VALUE error = Qnil;
+
+  try {
+    Update<K> update;
+    update_parse(pairs, update);
+    changed = update_apply(*data, update);
+  }
+  catch (Exiv2::AnyError& exiv2_error) {
+    error = rb_exc_new_cstr(basic_error_class, exiv2_error.what()); // Raised once the update has been freed.
+  }
+
+  if (!NIL_P(error)) rb_exc_raise(error);
+  if (changed) metadata_changed(self);
+  RB_GC_GUARD(pairs);
+  return self;
+}
+
+// Shared method for implementing delete_all on XmpData, IptcData and ExifData.
+template <class T, class K>
+static VALUE metadata_delete_all(VALUE self, VALUE key) {
+  T* data = get_data<T>(self);
+
+  std::string name = to_std_string(key);
+  long removed = 0;
+
+  try {
+    removed = metadata_erase_all(*data, parse_key<K>(name).key);
+  }
+  catch (Exiv2::AnyError& error) {
+    rb_raise(basic_error_class, "%s", error.what());
+  }
+
+  if (removed == 0) return Qfalse;
+
+  metadata_changed(self);
+  return Qtrue;
+}
+
+// Shared method for implementing [] on XmpData, IptcData and ExifData.
+template <class T, class K>
+static VALUE metadata_aref(VALUE self, VALUE key, const rb_encoding *encoding = UTF_8) {
+  return rb_ary_entry(metadata_values_at<T, K>(self, 1, &key, encoding), 0);
+}
+
+// Shared method for implementing keys on XmpData, IptcData and ExifData. Like each, a
+// key that's repeated is listed every time.
+template <class T>
+static VALUE metadata_keys(VALUE self) {
+  T* data = get_data<T>(self);
+
+  VALUE result = rb_ary_new_capa(data->count());
+  for (typename T::iterator it = data->begin(); it != data->end(); it++)
+    rb_ary_push(result, to_ruby_key(it->key()));
+
+  return result;
+}
+
+// Shared method for implementing key? on XmpData, IptcData and ExifData, without
+// converting any values. Invalid keys are never there.
+template <class T, class K>
+static VALUE metadata_has_key(VALUE self, VALUE key) {
+  T* data = get_data<T>(self);
+  std::string name = to_std_string(key);
+
+  try {
+    K parsed = parse_key<K>(name).key;
+
+    for (typename T::iterator it = data->begin(); it != data->end(); it++) {
+      if (key_matches(*it, parsed)) return Qtrue;
+    }
+  }
+  catch (Exiv2::AnyError&) {
+    // Not a valid key, so there's nothing to find.
+  }
+
+  return Qfalse;
+}
+
+// Shared method for implementing size on XmpData, IptcData and ExifData: the number of
+// data, counting each repeat of a key.
+template <class T>
+static VALUE metadata_size(VALUE self) {
+  return LONG2NUM(get_data<T>(self)->count());
+}
+
+// Whether a datum is in a group. Exif and IPTC groups compare their numeric ids, so
+// nothing needs formatting for the data that aren't.
+struct InExifGroup {
+  int ifd;
+  bool operator()(const Exiv2::Exifdatum& datum) const { return static_cast<int>(datum.ifdId()) == ifd; }
+};
+
+struct InIptcGroup {
+  uint16_t record;
+  bool operator()(const Exiv2::Iptcdatum& datum) const { return datum.record() == record; }
+};
+
+struct InXmpGroup {
+  std::string prefix;
+  bool operator()(const Exiv2::Xmpdatum& datum) const { return datum.groupName() == prefix; }
+};
+
+// Find a group from its name. Unknown names throw.
+static InExifGroup find_group(const Exiv2::ExifData&, const std::string& name) {
+  InExifGroup group = { static_cast<int>(Exiv2::ExifKey(0, name).ifdId()) };
+  return group;
+}
+
+static InIptcGroup find_group(const Exiv2::IptcData&, const std::string& name) {
+  InIptcGroup group = { Exiv2::IptcDataSets::recordId(name) };
+  return group;
+}
+
+static InXmpGroup find_group(const Exiv2::XmpData&, const std::string& name) {
+  InXmpGroup group = { name };
+  return group;
+}
+
+// Whether a datum's key starts with a prefix. When the prefix names a whole group, only
+// the data in the group have their keys checked (or none at all if the prefix is nothing
+// more than the group).
+template <class G>
+struct HasKeyPrefix {
+  bool in_group;
+  G group;
+  std::string prefix;
+  bool whole_group;
+
+  template <class D>
+  bool operator()(const D& datum) const {
+    if (in_group && !group(datum)) return false;
+    return whole_group || datum.key().compare(0, prefix.length(), prefix) == 0;
+  }
+};
+
+// Convert the data picked out by matches to a hash, grouped the same way as to_hash.
+template <class T, class P>
+static VALUE metadata_select(T& data, const P& matches, const rb_encoding *encoding) {
+  ConvertTimer timer;
+  VALUE result = rb_hash_new();
+
+  for (typename T::iterator it = data.begin(); it != data.end(); it++) {
+    if (!matches(*it)) continue;
+
+    VALUE value = metadatum_to_ruby(*it, encoding);
+    if (!value) continue;
+
+    VALUE key = to_ruby_key(it->key());
+    rb_hash_aset(result, key, group_value(rb_hash_lookup(result, key), value));
+  }
+
+  return result;
+}
+
+// Shared method for implementing select_group on XmpData, IptcData and ExifData. The
+// group can be given with or without its family, as "Exif.GPSInfo" or "GPSInfo". A group
+// that doesn't exist has nothing in it.
+template <class T>
+static VALUE metadata_select_group(VALUE self, VALUE name, const char* family, const rb_encoding *encoding = UTF_8) {
+  T* data = get_data<T>(self);
+  std::string group = to_std_string(name);
+
+  std::string family_prefix = std::string(family) + ".";
+  if (starts_with(group, family_prefix.c_str()))
+    group.erase(0, family_prefix.length());
+
+  try {
+    return metadata_select(*data, find_group(*data, group), encoding);
+  }
+  catch (Exiv2::AnyError&) {
+    return rb_hash_new();
+  }
+}
+
+// Shared method for implementing slice_prefix on XmpData, IptcData and ExifData: the data
+// whose keys start with prefix.
+template <class T>
+static VALUE metadata_slice_prefix(VALUE self, VALUE prefix, const char* family, const rb_encoding *encoding = UTF_8) {
+  T* data = get_data<T>(self);
+
+  HasKeyPrefix<decltype(find_group(*data, std::string()))> matches;
+  matches.in_group = false;
+  matches.prefix = to_std_string(prefix);
+  matches.whole_group = false;
+
+  // Everything in the data is in the same family, so either all of it might match, or none.
+  std::string family_prefix = std::string(family) + ".";
+  size_t common = std::min(matches.prefix.length(), family_prefix.length());
+  if (matches.prefix.compare(0, common, family_prefix, 0, common) != 0)
+    return rb_hash_new();
+
+  size_t group_end = matches.prefix.find('.', family_prefix.length());
+  if (group_end != std::string::npos) {
+    try {
+      matches.group = find_group(*data, matches.prefix.substr(family_prefix.length(), group_end - family_prefix.length()));
+      matches.in_group = true;
+      matches.whole_group = group_end + 1 == matches.prefix.length();
+    }
+    catch (Exiv2::AnyError&) {
+      return rb_hash_new();
+    }
+  }
+
+  return metadata_select(*data, matches, encoding);
+}
+
+// Keys to pick out of an image's metadata, split up by family. The indexes give each key's
+// position in names (and in the values looked up for an image).
+struct KeyFilter {
+  std::vector<Exiv2::ExifKey> exif;
+  std::vector<long> exif_indexes;
+  std::vector<Exiv2::IptcKey> iptc;
+  std::vector<long> iptc_indexes;
+  std::vector<Exiv2::XmpKey> xmp;
+  std::vector<long> xmp_indexes;
+  VALUE names;
+};
+
+static void key_filter_mark(void* filter) {
+  rb_gc_mark(static_cast<KeyFilter*>(filter)->names);
+}
+
+static void key_filter_free(void* filter) {
+  delete static_cast<KeyFilter*>(filter);
+}
+
+static const rb_data_type_t key_filter_type = {
+  "Exiv2::KeyFilter", { key_filter_mark, key_filter_free, 0 }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// Create a filter for an array of keys. It's owned by the (hidden) Ruby object that's
+// returned, so that it gets freed even if we raise before we're done with it.
+static VALUE key_filter_new(VALUE keys, KeyFilter** result) {
+  keys = rb_convert_type(keys, T_ARRAY, "Array", "to_ary");
+
+  KeyFilter* filter = new KeyFilter();
+  filter->names = rb_ary_new_capa(RARRAY_LEN(keys));
+  VALUE owner = TypedData_Wrap_Struct(0, &key_filter_type, filter);
+
+  try {
+    for (long i = 0; i < RARRAY_LEN(keys); i++) {
+      std::string name = to_std_string(rb_ary_entry(keys, i));
+      rb_ary_push(filter->names, to_ruby_key(name));
+
+      if (starts_with(name, "Iptc.")) {
+        filter->iptc.push_back(parse_key<Exiv2::IptcKey>(name).key);
+        filter->iptc_indexes.push_back(i);
+      }
+      else if (starts_with(name, "Xmp.")) {
+        filter->xmp.push_back(parse_key<Exiv2::XmpKey>(name).key);
+        filter->xmp_indexes.push_back(i);
+      }
+      else {
+        filter->exif.push_back(parse_key<Exiv2::ExifKey>(name).key);
+        filter->exif_indexes.push_back(i);
+      }
+    }
+  }
+  catch (Exiv2::AnyError& error) {
+    rb_raise(basic_error_class, "%s", error.what());
+  }
+
+  *result = filter;
+  return owner;
+}
+
+// Remove all the data in an image that aren't picked out by the filter.
+static void image_apply_key_filter(Exiv2::Image& image, const KeyFilter& filter) {
+  HasNoneOfKeys<Exiv2::ExifKey> not_exif = { filter.exif };
+  HasNoneOfKeys<Exiv2::IptcKey> not_iptc = { filter.iptc };
+  HasNoneOfKeys<Exiv2::XmpKey> not_xmp = { filter.xmp };
+
+  metadata_erase_if(image.exifData(), not_exif);
+  metadata_erase_if(image.iptcData(), not_iptc);
+  metadata_erase_if(image.xmpData(), not_xmp);
+}
+
+// The changes write_many makes to every image, parsed once for all of them.
+struct WritePatch {
+  Update<Exiv2::ExifKey> exif;
+  Update<Exiv2::IptcKey> iptc;
+  Update<Exiv2::XmpKey> xmp;
+};
+
+static void write_patch_free(void* patch) {
+  delete static_cast<WritePatch*>(patch);
+}
+
+static const rb_data_type_t write_patch_type = {
+  "Exiv2::WritePatch", { 0, write_patch_free, 0 }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// Create a patch from hashes of keys and values for each family, like update takes. It's
+// owned by the (hidden) Ruby object that's returned, the same as a key filter.
+static VALUE write_patch_new(VALUE exif, VALUE iptc, VALUE xmp, WritePatch** result) {
+  VALUE exif_pairs = update_pairs(exif);
+  VALUE iptc_pairs = update_pairs(iptc);
+  VALUE xmp_pairs = update_pairs(xmp);
+
+  WritePatch* patch = new WritePatch();
+  VALUE owner = TypedData_Wrap_Struct(0, &write_patch_type, patch);
+
+  try {
+    update_parse(exif_pairs, patch->exif);
+    update_parse(iptc_pairs, patch->iptc);
+    update_parse(xmp_pairs, patch->xmp);
+  }
+  catch (Exiv2::AnyError& error) {
+    rb_raise(basic_error_class, "%s", error.what());
+  }
+
+  RB_GC_GUARD(exif_pairs);
+  RB_GC_GUARD(iptc_pairs);
+  RB_GC_GUARD(xmp_pairs);
+
+  *result = patch;
+  return owner;
+}
+
+static ID open_options[1];
+static ID read_metadata_options[2];
+static ID write_metadata_options[1];
+static ID xmp_packet_options[1];
+static ID conversion_options[1];
+
+// The types of column extract fills in, and their names as given to it.
+enum ColumnType { column_int64, column_float64, column_string };
+
+static struct {
+  ID id;
+  ColumnType type;
+} column_types[] = {
+  { 0, column_int64 },
+  { 0, column_float64 },
+  { 0, column_string },
+};
+
+// The types of metadata that can be given to read_metadata's only: option.
+static struct {
+  ID id;
+  int metadata_id;
+} metadata_types[] = {
+  { 0, Exiv2::mdExif },
+  { 0, Exiv2::mdIptc },
+  { 0, Exiv2::mdXmp },
+  { 0, Exiv2::mdIccProfile },
+  { 0, Exiv2::mdComment },
+};
+
+static int parse_metadata_types(VALUE types) {
+  types = rb_Array(types);
+  int result = Exiv2::mdNone;
+
+  for (long i = 0; i < RARRAY_LEN(types); i++) {
+    VALUE type = rb_ary_entry(types, i);
+    size_t t = 0;
+
+    while (t < sizeof(metadata_types) / sizeof(metadata_types[0]) && !(SYMBOL_P(type) && SYM2ID(type) == metadata_types[t].id))
+      t++;
+    if (t == sizeof(metadata_types) / sizeof(metadata_types[0]))
+      rb_raise(rb_eArgError, "unknown type of metadata: %" PRIsVALUE, rb_inspect(type));
+
+    result |= metadata_types[t].metadata_id;
+  }
+
+  return result;
+}
+
+typedef VALUE (*Method)(...);
+
+static void iptc_init_charsets();
+
+static VALUE exiv2_module;
+static VALUE exiv2_read_many(VALUE self, VALUE paths, VALUE threads, VALUE keys);
+static VALUE exiv2_extract(VALUE self, VALUE paths, VALUE threads, VALUE keys, VALUE types);
+static VALUE exiv2_write_many(VALUE self, VALUE paths, VALUE threads, VALUE exif, VALUE iptc, VALUE xmp);
+static VALUE exiv2_stats(VALUE self);
+static VALUE exiv2_reset_stats(VALUE self);
+static VALUE exiv2_stats_enabled(VALUE self);
+static VALUE exiv2_set_stats_enabled(VALUE self, VALUE enabled);
+static VALUE exiv2_probe(VALUE self, VALUE path);
+static VALUE exiv2_probe_buffer(VALUE self, VALUE buffer);
+
+static VALUE probe_result_class;
+static VALUE column_class;
+static VALUE extraction_class;
+static VALUE preview_properties_class;
+
+static VALUE datum_class;
+static void datum_mark(void* datum);
+static const rb_data_type_t datum_type = {
+  "Exiv2::Datum", { datum_mark, RUBY_TYPED_DEFAULT_FREE, 0 }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+static VALUE datum_key(VALUE self);
+static VALUE datum_type_name(VALUE self);
+static VALUE datum_count(VALUE self);
+static VALUE datum_size(VALUE self);
+static VALUE datum_value(int argc, VALUE *argv, VALUE self);
+
+static VALUE image_class;
+static void image_mark(void* image);
+static void image_free(void* image);
+static size_t image_memsize(const void* image);
+static const rb_data_type_t image_type = {
+  "Exiv2::Image", { image_mark, image_free, image_memsize }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+static Exiv2::Image* get_image(VALUE self);
+static VALUE image_wrap(Exiv2::Image* image);
+static VALUE image_read_metadata(int argc, VALUE *argv, VALUE self);
+static VALUE image_write_metadata(int argc, VALUE *argv, VALUE self);
+static VALUE image_iptc_data(VALUE self);
+static VALUE image_xmp_data(VALUE self);
+static VALUE image_exif_data(VALUE self);
+static VALUE image_copy_to_image(VALUE self, VALUE other);
+static VALUE image_clear(VALUE self);
+static VALUE image_set_xmp_packet(VALUE self, VALUE xmp_packet);
+static VALUE image_xmp_packet(int argc, VALUE *argv, VALUE self);
+static VALUE image_set_icc_profile(VALUE self, VALUE icc_profile);
+static VALUE image_clear_icc_profile(VALUE self);
+static VALUE image_has_icc_profile(VALUE self);
+static VALUE image_dirty(VALUE self);
+static VALUE image_close(VALUE self);
+static VALUE image_closed(VALUE self);
+static VALUE image_icc_profile(VALUE self);
+static VALUE image_previews(VALUE self);
+static VALUE image_preview_data(VALUE self, VALUE index);
+
+static VALUE icc_profile_class;
+static void icc_profile_free(void* icc_profile);
+static size_t icc_profile_memsize(const void* icc_profile);
+// Profiles never change once they've been made, so (being frozen) they can be shared
+// between Ractors where the Ruby version has them.
+#ifdef HAVE_CONST_RUBY_TYPED_FROZEN_SHAREABLE
+#define ICC_PROFILE_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE)
+#else
+#define ICC_PROFILE_FLAGS RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+static const rb_data_type_t icc_profile_type = {
+  "Exiv2::IccProfile", { 0, icc_profile_free, icc_profile_memsize }, 0, 0, ICC_PROFILE_FLAGS
+};
+static VALUE icc_profile_new(VALUE klass, VALUE data);
+static VALUE icc_profile_read(VALUE klass, VALUE path);
+static VALUE icc_profile_size(VALUE self);
+static VALUE icc_profile_to_s(VALUE self);
+
+static VALUE image_factory_class;
+static VALUE image_factory_open(int argc, VALUE *argv, VALUE klass);
+static VALUE image_factory_open_buffer(VALUE klass, VALUE buffer);
+static VALUE image_factory_open_io(VALUE klass, VALUE io);
+
+static VALUE exif_data_class;
+static VALUE exif_data_each(int argc, VALUE *argv, VALUE self);
+static VALUE exif_data_to_hash(int argc, VALUE *argv, VALUE self);
+static VALUE exif_data_aref(VALUE self, VALUE key);
+static VALUE exif_data_values_at(int argc, VALUE *argv, VALUE self);
+static VALUE exif_data_each_datum(VALUE self);
+static VALUE exif_data_keys(VALUE self);
+static VALUE exif_data_has_key(VALUE self, VALUE key);
+static VALUE exif_data_size(VALUE self);
+static VALUE exif_data_select_group(VALUE self, VALUE group);
+static VALUE exif_data_slice_prefix(VALUE self, VALUE prefix);
+static VALUE exif_data_add(VALUE self, VALUE key, VALUE value);
+static VALUE exif_data_delete(VALUE self, VALUE key);
+static VALUE exif_data_delete_all(VALUE self, VALUE key);
+static VALUE exif_data_clear(VALUE self);
+static VALUE exif_data_unchanged(VALUE self, VALUE key, VALUE values);
+static VALUE exif_data_update(VALUE self, VALUE hash);
+static VALUE exif_data_to_blob(VALUE self);
+static VALUE exif_data_from_blob(VALUE klass, VALUE blob);
+
+static VALUE iptc_data_class;
+static VALUE iptc_data_each(int argc, VALUE *argv, VALUE self);
+static VALUE iptc_data_to_hash(int argc, VALUE *argv, VALUE self);
+static VALUE iptc_data_aref(VALUE self, VALUE key);
+static VALUE iptc_data_values_at(int argc, VALUE *argv, VALUE self);
+static VALUE iptc_data_each_datum(VALUE self);
+static VALUE iptc_data_keys(VALUE self);
+static VALUE iptc_data_has_key(VALUE self, VALUE key);
+static VALUE iptc_data_size(VALUE self);
+static VALUE iptc_data_select_group(VALUE self, VALUE group);
+static VALUE iptc_data_slice_prefix(VALUE self, VALUE prefix);
+static VALUE iptc_data_add(VALUE self, VALUE key, VALUE value);
+static VALUE iptc_data_delete(VALUE self, VALUE key);
+static VALUE iptc_data_delete_all(VALUE self, VALUE key);
+static VALUE iptc_data_clear(VALUE self);
+static VALUE iptc_data_unchanged(VALUE self, VALUE key, VALUE values);
+static VALUE iptc_data_update(VALUE self, VALUE hash);
+static VALUE iptc_data_to_blob(VALUE self);
+static VALUE iptc_data_from_blob(VALUE klass, VALUE blob);
+
+static VALUE xmp_data_class;
+static VALUE xmp_data_each(int argc, VALUE *argv, VALUE self);
+static VALUE xmp_data_to_hash(int argc, VALUE *argv, VALUE self);
+static VALUE xmp_data_aref(VALUE self, VALUE key);
+static VALUE xmp_data_values_at(int argc, VALUE *argv, VALUE self);
+static VALUE xmp_data_each_datum(VALUE self);
+static VALUE xmp_data_keys(VALUE self);
+static VALUE xmp_data_has_key(VALUE self, VALUE key);
+static VALUE xmp_data_size(VALUE self);
+static VALUE xmp_data_select_group(VALUE self, VALUE group);
+static VALUE xmp_data_slice_prefix(VALUE self, VALUE prefix);
+static VALUE xmp_data_add(VALUE self, VALUE key, VALUE value);
+static VALUE xmp_data_delete(VALUE self, VALUE key);
+static VALUE xmp_data_delete_all(VALUE self, VALUE key);
+static VALUE xmp_data_clear(VALUE self);
+static VALUE xmp_data_unchanged(VALUE self, VALUE key, VALUE values);
+static VALUE xmp_data_update(VALUE self, VALUE hash);
+
+extern "C" void Init_exiv2() {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // Everything kept globally is set up here and only read afterwards, apart from the key
+  // cache and the XMP toolkit, which have their own locks. Images and their data belong to
+  // the Ractor that opened them, like any other unshareable object.
+  rb_ext_ractor_safe(true);
+#endif
+
+  VALUE enumerable_module = rb_const_get(rb_cObject, rb_intern("Enumerable"));
+
+  exiv2_module = rb_define_module("Exiv2");
+
+  basic_error_class = rb_define_class_under(exiv2_module, "BasicError", rb_eRuntimeError);
+
+  rb_define_private_method(rb_singleton_class(exiv2_module), "_read_many", (Method)exiv2_read_many, 3);
+  rb_define_private_method(rb_singleton_class(exiv2_module), "_extract", (Method)exiv2_extract, 4);
+  rb_define_private_method(rb_singleton_class(exiv2_module), "_write_many", (Method)exiv2_write_many, 5);
+  rb_define_singleton_method(exiv2_module, "probe", (Method)exiv2_probe, 1);
+  rb_define_singleton_method(exiv2_module, "probe_buffer", (Method)exiv2_probe_buffer, 1);
+  rb_define_singleton_method(exiv2_module, "stats", (Method)exiv2_stats, 0);
+  rb_define_singleton_method(exiv2_module, "reset_stats", (Method)exiv2_reset_stats, 0);
+  rb_define_singleton_method(exiv2_module, "stats_enabled?", (Method)exiv2_stats_enabled, 0);
+  rb_define_singleton_method(exiv2_module, "stats_enabled=", (Method)exiv2_set_stats_enabled, 1);
+
+  probe_result_class = rb_struct_define_under(exiv2_module, "ProbeResult", "type", "mime_type", "width", "height", NULL);
+  column_class = rb_struct_define_under(exiv2_module, "Column", "type", "length", "data", "offsets", "validity", "null_count", NULL);
+  extraction_class = rb_struct_define_under(exiv2_module, "Extraction", "length", "columns", "errors", NULL);
+  preview_properties_class = rb_struct_define_under(exiv2_module, "PreviewProperties", "mime_type", "extension", "size", "width", "height", NULL);
+
+  Exiv2::XmpParser::initialize(xmp_lock, &xmp_mutex);
+
+  UTF_8 = rb_utf8_encoding();
+  ISO_8859_1 = rb_enc_find("ISO-8859-1");
+  iptc_init_charsets();
+
+  rb_require("date");
+  date_class = rb_const_get(rb_cObject, rb_intern("Date"));
+  rb_global_variable(&date_class);
+
+  id_new = rb_intern("new");
+  id_to_s = rb_intern("to_s");
+  id_read = rb_intern("read");
+  id_seek = rb_intern("seek");
+  id_size = rb_intern("size");
+  id_write = rb_intern("write");
+  id_image = rb_intern("@image");
+  sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+
+  open_options[0] = rb_intern("mmap");
+  read_metadata_options[0] = rb_intern("only");
+  read_metadata_options[1] = rb_intern("keys");
+  write_metadata_options[0] = rb_intern("to");
+  xmp_packet_options[0] = rb_intern("scan");
+  conversion_options[0] = rb_intern("raw");
+  metadata_types[0].id = rb_intern("exif");
+  metadata_types[1].id = rb_intern("iptc");
+  metadata_types[2].id = rb_intern("xmp");
+  metadata_types[3].id = rb_intern("icc");
+  metadata_types[4].id = rb_intern("comment");
+  column_types[0].id = rb_intern("int64");
+  column_types[1].id = rb_intern("float64");
+  column_types[2].id = rb_intern("string");
+
+  image_class = rb_define_class_under(exiv2_module, "Image", rb_cObject);
+  rb_undef_alloc_func(image_class);
+  rb_define_method(image_class, "read_metadata", (Method)image_read_metadata, -1);
+  rb_define_method(image_class, "write_metadata", (Method)image_write_metadata, -1);
+  rb_define_method(image_class, "iptc_data", (Method)image_iptc_data, 0);
+  rb_define_method(image_class, "xmp_data", (Method)image_xmp_data, 0);
+  rb_define_method(image_class, "exif_data", (Method)image_exif_data, 0);
+  rb_define_method(image_class, "copy_to_image", (Method)image_copy_to_image, 1);
+  rb_define_method(image_class, "clear", (Method)image_clear, 0);
+  rb_define_method(image_class, "set_xmp_packet", (Method)image_set_xmp_packet, 1);
+  rb_define_method(image_class, "xmp_packet", (Method)image_xmp_packet, -1);
+  rb_define_method(image_class, "set_icc_profile", (Method)image_set_icc_profile, 1);
+  rb_define_method(image_class, "clear_icc_profile", (Method)image_clear_icc_profile, 0);
+  rb_define_method(image_class, "has_icc_profile?", (Method)image_has_icc_profile, 0);
+  rb_define_method(image_class, "dirty?", (Method)image_dirty, 0);
+  rb_define_method(image_class, "close", (Method)image_close, 0);
+  rb_define_method(image_class, "closed?", (Method)image_closed, 0);
+  rb_define_method(image_class, "icc_profile", (Method)image_icc_profile, 0);
+  rb_define_method(image_class, "previews", (Method)image_previews, 0);
+  rb_define_method(image_class, "preview_data", (Method)image_preview_data, 1);
+
+  icc_profile_class = rb_define_class_under(exiv2_module, "IccProfile", rb_cObject);
+  rb_undef_alloc_func(icc_profile_class);
+  rb_define_singleton_method(icc_profile_class, "new", (Method)icc_profile_new, 1);
+  rb_define_singleton_method(icc_profile_class, "read", (Method)icc_profile_read, 1);
+  rb_define_method(icc_profile_class, "size", (Method)icc_profile_size, 0);
+  rb_define_method(icc_profile_class, "to_s", (Method)icc_profile_to_s, 0);
+
+  datum_class = rb_define_class_under(exiv2_module, "Datum", rb_cObject);
+  rb_undef_alloc_func(datum_class);
+  rb_define_method(datum_class, "key", (Method)datum_key, 0);
+  rb_define_method(datum_class, "type", (Method)datum_type_name, 0);
+  rb_define_method(datum_class, "count", (Method)datum_count, 0);
+  rb_define_method(datum_class, "size", (Method)datum_size, 0);
+  rb_define_method(datum_class, "value", (Method)datum_value, -1);
+
+  image_factory_class = rb_define_class_under(exiv2_module, "ImageFactory", rb_cObject);
+  rb_define_singleton_method(image_factory_class, "open", (Method)image_factory_open, -1);
+  rb_define_singleton_method(image_factory_class, "open_buffer", (Method)image_factory_open_buffer, 1);
+  rb_define_singleton_method(image_factory_class, "open_io", (Method)image_factory_open_io, 1);
+
+  exif_data_class = rb_define_class_under(exiv2_module, "ExifData", rb_cObject);
+  rb_undef_alloc_func(exif_data_class);
+  rb_include_module(exif_data_class, enumerable_module);
+  rb_define_method(exif_data_class, "each", (Method)exif_data_each, -1);
+  rb_define_method(exif_data_class, "to_hash", (Method)exif_data_to_hash, -1);
+  rb_define_method(exif_data_class, "[]", (Method)exif_data_aref, 1);
+  rb_define_method(exif_data_class, "values_at", (Method)exif_data_values_at, -1);
+  rb_define_method(exif_data_class, "each_datum", (Method)exif_data_each_datum, 0);
+  rb_define_method(exif_data_class, "keys", (Method)exif_data_keys, 0);
+  rb_define_method(exif_data_class, "key?", (Method)exif_data_has_key, 1);
+  rb_define_method(exif_data_class, "size", (Method)exif_data_size, 0);
+  rb_define_method(exif_data_class, "select_group", (Method)exif_data_select_group, 1);
+  rb_define_method(exif_data_class, "slice_prefix", (Method)exif_data_slice_prefix, 1);
+  rb_define_method(exif_data_class, "add", (Method)exif_data_add, 2);
+  rb_define_method(exif_data_class, "delete", (Method)exif_data_delete, 1);
+  rb_define_method(exif_data_class, "delete_all", (Method)exif_data_delete_all, 1);
+  rb_define_method(exif_data_class, "clear", (Method)exif_data_clear, 0);
+  rb_define_method(exif_data_class, "update", (Method)exif_data_update, 1);
+  rb_define_method(exif_data_class, "to_blob", (Method)exif_data_to_blob, 0);
+  rb_define_singleton_method(exif_data_class, "from_blob", (Method)exif_data_from_blob, 1);
+  rb_define_private_method(exif_data_class, "_unchanged?", (Method)exif_data_unchanged, 2);
+
+  iptc_data_class = rb_define_class_under(exiv2_module, "IptcData", rb_cObject);
+  rb_undef_alloc_func(iptc_data_class);
+  rb_include_module(iptc_data_class, enumerable_module);
+  rb_define_method(iptc_data_class, "each", (Method)iptc_data_each, -1);
+  rb_define_method(iptc_data_class, "to_hash", (Method)iptc_data_to_hash, -1);
+  rb_define_method(iptc_data_class, "[]", (Method)iptc_data_aref, 1);
+  rb_define_method(iptc_data_class, "values_at", (Method)iptc_data_values_at, -1);
+  rb_define_method(iptc_data_class, "each_datum", (Method)iptc_data_each_datum, 0);
+  rb_define_method(iptc_data_class, "keys", (Method)iptc_data_keys, 0);
+  rb_define_method(iptc_data_class, "key?", (Method)iptc_data_has_key, 1);
+  rb_define_method(iptc_data_class, "size", (Method)iptc_data_size, 0);
+  rb_define_method(iptc_data_class, "select_group", (Method)iptc_data_select_group, 1);
+  rb_define_method(iptc_data_class, "slice_prefix", (Method)iptc_data_slice_prefix, 1);
+  rb_define_method(iptc_data_class, "add", (Method)iptc_data_add, 2);
+  rb_define_method(iptc_data_class, "delete", (Method)iptc_data_delete, 1);
+  rb_define_method(iptc_data_class, "delete_all", (Method)iptc_data_delete_all, 1);
+  rb_define_method(iptc_data_class, "clear", (Method)iptc_data_clear, 0);
+  rb_define_method(iptc_data_class, "update", (Method)iptc_data_update, 1);
+  rb_define_method(iptc_data_class, "to_blob", (Method)iptc_data_to_blob, 0);
+  rb_define_singleton_method(iptc_data_class, "from_blob", (Method)iptc_data_from_blob, 1);
+  rb_define_private_method(iptc_data_class, "_unchanged?", (Method)iptc_data_unchanged, 2);
+
+  xmp_data_class = rb_define_class_under(exiv2_module, "XmpData", rb_cObject);
+  rb_undef_alloc_func(xmp_data_class);
+  rb_include_module(xmp_data_class, enumerable_module);
+  rb_define_method(xmp_data_class, "each", (Method)xmp_data_each, -1);
+  rb_define_method(xmp_data_class, "to_hash", (Method)xmp_data_to_hash, -1);
+  rb_define_method(xmp_data_class, "[]", (Method)xmp_data_aref, 1);
+  rb_define_method(xmp_data_class, "values_at", (Method)xmp_data_values_at, -1);
+  rb_define_method(xmp_data_class, "each_datum", (Method)xmp_data_each_datum, 0);
+  rb_define_method(xmp_data_class, "keys", (Method)xmp_data_keys, 0);
+  rb_define_method(xmp_data_class, "key?", (Method)xmp_data_has_key, 1);
+  rb_define_method(xmp_data_class, "size", (Method)xmp_data_size, 0);
+  rb_define_method(xmp_data_class, "select_group", (Method)xmp_data_select_group, 1);
+  rb_define_method(xmp_data_class, "slice_prefix", (Method)xmp_data_slice_prefix, 1);
+  rb_define_method(xmp_data_class, "add", (Method)xmp_data_add, 2);
+  rb_define_method(xmp_data_class, "delete", (Method)xmp_data_delete, 1);
+  rb_define_method(xmp_data_class, "delete_all", (Method)xmp_data_delete_all, 1);
+  rb_define_method(xmp_data_class, "clear", (Method)xmp_data_clear, 0);
+  rb_define_method(xmp_data_class, "update", (Method)xmp_data_update, 1);
+  rb_define_private_method(xmp_data_class, "_unchanged?", (Method)xmp_data_unchanged, 2);
+}
+
+
+// An Exiv2::MemIo that reads straight from the bytes of a frozen Ruby string, rather
+// than from a copy of them. The image marks the string, which keeps it alive (and stops
+// compaction from moving it) for as long as Exiv2 may look at its bytes.
+class StringIo : public Exiv2::MemIo {
+public:
+  explicit StringIo(VALUE string)
+    : Exiv2::MemIo(reinterpret_cast<const Exiv2::byte*>(RSTRING_PTR(string)), RSTRING_LEN(string)), string_(string) {}
+
+  VALUE string() const { return string_; }
+
+private:
+  VALUE string_;
+};
+
+
+// An Exiv2::BasicIo that reads from a Ruby IO (or anything else with read, seek and size,
+// like a StringIO), so images can be parsed straight from sockets, archives and the like.
+// Exiv2 reads lots of small pieces, so they're served from a buffer that's refilled a
+// chunk at a time, and each refill takes the GVL back just for the Ruby calls.
+//
+// Writing isn't supported. The errors array keeps any exceptions raised by the IO safe
+// from the GC until they can be raised again, and the image marks both it and the IO.
+class RubyIo : public Exiv2::BasicIo {
+public:
+  static const long chunk_size = 64 * 1024;
+
+  RubyIo(VALUE io, VALUE errors, long size, const std::string& path)
+    : io_(io), errors_(errors), size_(size), path_(path), position_(0), ruby_position_(-1),
+      buffer_start_(0), open_(false), eof_(false) {}
+
+  VALUE io() const { return io_; }
+  VALUE errors() const { return errors_; }
+  size_t memsize() const { return buffer_.capacity() + mapped_.capacity(); }
+
+  int open() {
+    open_ = true;
+    eof_ = false;
+    position_ = 0;
+    ruby_position_ = -1; // Somebody else may have moved it since we last looked.
+    return 0;
+  }
+
+  int close() {
+    munmap();
+    open_ = false;
+    return 0;
+  }
+
+  long write(const Exiv2::byte*, long) { return 0; }
+  long write(Exiv2::BasicIo&) { return 0; }
+  int putb(Exiv2::byte) { return EOF; }
+
+  void transfer(Exiv2::BasicIo&) {
+    throw Exiv2::Error(Exiv2::kerErrorMessage, "images opened from an IO can't be written");
+  }
+
+  Exiv2::DataBuf read(long count) {
+    Exiv2::DataBuf buf(count);
+    buf.size_ = read(buf.pData_, count);
+    return buf;
+  }
+
+  long read(Exiv2::byte* buf, long count) {
+    long total = 0;
+
+    while (total < count) {
+      if ((position_ < buffer_start_ || position_ >= buffer_start_ + static_cast<long>(buffer_.size())) && !fill(count - total))
+        break;
+
+      long offset = position_ - buffer_start_;
+      long length = std::min(count - total, static_cast<long>(buffer_.size()) - offset);
+      std::memcpy(buf + total, buffer_.data() + offset, length);
+      total += length;
+      position_ += length;
+    }
+
+    if (total < count) eof_ = true;
+    return total;
+  }
+
+  int getb() {
+    Exiv2::byte byte;
+    return read(&byte, 1) == 1 ? byte : EOF;
+  }
+
+#if defined(_MSC_VER)
+  int seek(int64_t offset, Position pos) {
+#else
+  int seek(long offset, Position pos) {
+#endif
+    long position;
+    switch (pos) {
+      case beg: position = offset; break;
+      case cur: position = position_ + offset; break;
+      default:  position = size_ + offset; break;
+    }
+    if (position < 0) return 1;
+
+    position_ = position;
+    eof_ = false;
+    return 0;
+  }
+
+  // Exiv2 maps the whole file for some formats (TIFF and the raw formats based on it), so
+  // that reads the lot into memory.
+  Exiv2::byte* mmap(bool isWriteable = false) {
+    if (isWriteable) throw Exiv2::Error(Exiv2::kerErrorMessage, "images opened from an IO can't be written");
+
+    if (mapped_.empty() && size_ > 0) {
+      std::string mapped(size_, '\0');
+      long position = position_;
+      position_ = 0;
+      long length = read(reinterpret_cast<Exiv2::byte*>(&mapped[0]), size_);
+      position_ = position;
+      eof_ = false;
+      mapped.resize(length);
+      mapped_.swap(mapped);
+    }
+    return reinterpret_cast<Exiv2::byte*>(&mapped_[0]);
+  }
+
+  int munmap() {
+    std::string().swap(mapped_);
+    return 0;
+  }
+
+  long tell() const { return position_; }
+  size_t size() const { return size_; }
+  bool isopen() const { return open_; }
+  int error() const { return 0; }
+  bool eof() const { return eof_; }
+  std::string path() const { return path_; }
+  void populateFakeData() {}
+
+private:
+  struct Fill {
+    RubyIo* io;
+    long length;
+  };
+
+  // Read at least length bytes (or a chunk, whichever is more) from the current position
+  // into the buffer. Runs with the GVL.
+  static VALUE fill_with_gvl(VALUE arg) {
+    Fill* fill = reinterpret_cast<Fill*>(arg);
+    RubyIo* io = fill->io;
+
+    if (io->ruby_position_ != io->position_) {
+      rb_funcall(io->io_, id_seek, 1, LONG2NUM(io->position_));
+      io->ruby_position_ = io->position_;
+    }
+
+    VALUE data = rb_funcall(io->io_, id_read, 1, LONG2NUM(std::max(fill->length, chunk_size)));
+    if (NIL_P(data)) return Qfalse;
+
+    StringValue(data);
+    io->buffer_.assign(RSTRING_PTR(data), RSTRING_LEN(data));
+    io->buffer_start_ = io->position_;
+    io->ruby_position_ = io->position_ + RSTRING_LEN(data);
+    return io->buffer_.empty() ? Qfalse : Qtrue;
+  }
+
+  bool fill(long length) {
+    Fill fill = { this, length };
+    return RTEST(call_with_gvl(fill_with_gvl, reinterpret_cast<VALUE>(&fill), errors_));
+  }
+
+  VALUE io_;
+  VALUE errors_;
+  long size_;
+  std::string path_;
+  long position_;
+  long ruby_position_;
+  std::string buffer_;
+  long buffer_start_;
+  std::string mapped_;
+  bool open_;
+  bool eof_;
+};
+
+
+// A file mapped into memory by an Exiv2::FileIo. It's a base class of MappedFileIo, rather
+// than a member, so that it's been set up by the time the MemIo is.
+struct MappedFile {
+  explicit MappedFile(const std::string& path) : file(path), mapped_data(NULL), mapped_size(0) {
+    if (file.open("rb") != 0)
+      throw Exiv2::Error(Exiv2::kerDataSourceOpenFailed, path, Exiv2::strError());
+
+    mapped_size = static_cast<long>(file.size());
+    if (mapped_size > 0) mapped_data = file.mmap();
+  }
+
+  Exiv2::FileIo file;
+  Exiv2::byte* mapped_data;
+  long mapped_size;
+};
+
+// An Exiv2::MemIo that reads a local file through a memory mapping, so that parsing goes
+// straight through the page cache instead of copying every read into Exiv2's buffers.
+// Writing transfers the new image to the file, as FileIo does, after which it's read from
+// memory.
+class MappedFileIo : private MappedFile, public Exiv2::MemIo {
+public:
+  explicit MappedFileIo(const std::string& path) : MappedFile(path), Exiv2::MemIo(mapped_data, mapped_size) {}
+
+  void transfer(Exiv2::BasicIo& src) {
+    file.transfer(src); // Unmaps the file before writing to it.
+    Exiv2::MemIo::transfer(src);
+  }
+
+  std::string path() const { return file.path(); }
+};
+
+
+// Exiv2::Image Methods
+
+// What an Exiv2::Image wraps. The image is freed (and set to NULL) when it's closed, which
+// can't happen while a call is using it: each pins it for as long as it yields, and so do
+// calls that let other threads run while Exiv2 works on it.
+struct ImageHandle {
+  Exiv2::Image* image;
+  long pins;
+  size_t reported; // The memory the GC has been told the image takes up.
+};
+
+static void image_mark(void* ptr) {
+  Exiv2::Image* image = static_cast<ImageHandle*>(ptr)->image;
+  if (!image) return;
+
+  StringIo* io = dynamic_cast<StringIo*>(&image->io());
+  if (io) rb_gc_mark(io->string());
+
+  RubyIo* ruby_io = dynamic_cast<RubyIo*>(&image->io());
+  if (ruby_io) {
+    rb_gc_mark(ruby_io->io());
+    rb_gc_mark(ruby_io->errors());
+  }
+}
+
+// Tell the GC how much memory an image takes up, so it doesn't go by the few bytes of the
+// Ruby object alone when deciding whether to collect. Only the change since it was last
+// told is reported, and it's all given back when the image is freed.
+static void image_report_memory(ImageHandle* handle, size_t size) {
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  rb_gc_adjust_memory_usage(static_cast<ssize_t>(size) - static_cast<ssize_t>(handle->reported));
+#endif
+  handle->reported = size;
+}
+
+static void image_free(void* ptr) {
+  ImageHandle* handle = static_cast<ImageHandle*>(ptr);
+
+  image_report_memory(handle, 0);
+  delete handle->image;
+  delete handle;
+}
+
+// Roughly how much memory the image takes up in Exiv2: its metadata, ICC profile and the
+// buffers of its IO, where it has any.
+static size_t exiv2_image_memsize(Exiv2::Image* image) {
+  if (!image) return 0;
+
+  size_t size = sizeof(*image) +
+    metadata_memsize(image->exifData()) +
+    metadata_memsize(image->iptcData()) +
+    metadata_memsize(image->xmpData()) +
+    image->xmpPacket().capacity();
+
+  if (image->iccProfileDefined()) size += image->iccProfile()->size_;
+
+  RubyIo* ruby_io = dynamic_cast<RubyIo*>(&image->io());
+  if (ruby_io) size += ruby_io->memsize();
+
+  return size;
+}
+
+static size_t image_memsize(const void* ptr) {
+  const ImageHandle* handle = static_cast<const ImageHandle*>(ptr);
+  return sizeof(*handle) + exiv2_image_memsize(handle->image);
+}
+
+static ImageHandle* get_image_handle(VALUE self) {
+  return static_cast<ImageHandle*>(rb_check_typeddata(self, &image_type));
+}
+
+// Let the GC know the image has (most likely) changed size, after its metadata is read.
+static void image_allocated(VALUE self) {
+  ImageHandle* handle = get_image_handle(self);
+  image_report_memory(handle, exiv2_image_memsize(handle->image));
+}
+
+static Exiv2::Image* get_image(VALUE self) {
+  Exiv2::Image* image = get_image_handle(self)->image;
+  if (!image) rb_raise(rb_eIOError, "closed image");
+  return image;
+}
+
+static bool image_is_closed(VALUE self) {
+  return !get_image_handle(self)->image;
+}
+
+// Stop the image being closed until it's unpinned. Raises if it's already closed.
+static void image_pin(VALUE self) {
+  get_image(self);
+  get_image_handle(self)->pins++;
+}
+
+static VALUE image_unpin(VALUE self) {
+  get_image_handle(self)->pins--;
+  return Qnil;
+}
+
+template <class T>
+struct PinnedCall {
+  void (*work)(T*);
+  T* data;
+};
+
+template <class T>
+static VALUE pinned_without_gvl(VALUE arg) {
+  PinnedCall<T>* call = reinterpret_cast<PinnedCall<T>*>(arg);
+  without_gvl(call->work, call->data);
+  return Qnil;
+}
+
+// Run a call into Exiv2 on the image with without_gvl, with the image pinned so that
+// other threads can't close it in the meantime.
+template <class T>
+static void image_without_gvl(VALUE self, void (*work)(T *), T *data) {
+  image_pin(self);
+
+  PinnedCall<T> call = { work, data };
+  rb_ensure(pinned_without_gvl<T>, reinterpret_cast<VALUE>(&call), image_unpin, self);
+}
+
+static VALUE image_wrap(Exiv2::Image* image) {
+  ImageHandle* handle = new ImageHandle();
+  handle->image = image;
+  VALUE result = TypedData_Wrap_Struct(image_class, &image_type, handle);
+  image_allocated(result);
+  return result;
+}
+
+// Free the image (and close its file) straight away, rather than waiting for the GC.
+// Anything else done with it, or with its data, raises IOError, and so does closing it
+// while it's in use, in a block given to each or by a read or write on another thread.
+static VALUE image_close(VALUE self) {
+  ImageHandle* handle = get_image_handle(self);
+  if (handle->pins > 0) rb_raise(rb_eIOError, "can't close an image that's in use");
+
+  image_report_memory(handle, 0);
+  delete handle->image;
+  handle->image = NULL;
+
+  return Qnil;
+}
+
+static VALUE image_closed(VALUE self) {
+  return image_is_closed(self) ? Qtrue : Qfalse;
+}
+
+struct ReadMetadataCall {
+  Exiv2::Image* image;
+  int keep;          // The types of metadata to keep, as Exiv2::MetadataId bits.
+  KeyFilter* filter; // The keys to keep, if not all of them.
+};
+
+static void read_metadata_without_gvl(ReadMetadataCall* call) {
+  Exiv2::Image* image = call->image;
+  {
+    PhaseTimer timer(phase_read);
+    image->readMetadata();
+    if (timer.enabled()) timer.add_bytes(image->io().size());
+  }
+
+  if (!(call->keep & Exiv2::mdExif)) image->clearExifData();
+  if (!(call->keep & Exiv2::mdIptc)) image->clearIptcData();
+  if (!(call->keep & Exiv2::mdXmp)) {
+    image->clearXmpPacket();
+    image->clearXmpData();
+  }
+  if (!(call->keep & Exiv2::mdIccProfile)) image->clearIccProfile();
+  if (!(call->keep & Exiv2::mdComment)) image->clearComment();
+
+  if (call->filter) image_apply_key_filter(*image, *call->filter);
+}
+
+// Exiv2 always parses all of an image's metadata, so the only: and keys: options don't
+// make reading any quicker. The types and keys that weren't asked for are dropped before
+// the GVL's taken back, though, so they don't take up memory or get converted. An image that's only been partly read can't be written, as
+// that would remove the rest of its metadata from the file.
+static VALUE image_read_metadata(int argc, VALUE *argv, VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  VALUE options, values[2] = { Qundef, Qundef };
+  rb_scan_args(argc, argv, "0:", &options);
+  if (!NIL_P(options)) rb_get_kwargs(options, read_metadata_options, 0, 2, values);
+
+  const int all = Exiv2::mdExif | Exiv2::mdIptc | Exiv2::mdXmp | Exiv2::mdIccProfile | Exiv2::mdComment;
+  ReadMetadataCall call = { image, all, NULL };
+  VALUE filter_owner = Qnil;
+  if (values[0] != Qundef && !NIL_P(values[0])) call.keep = parse_metadata_types(values[0]);
+  if (values[1] != Qundef && !NIL_P(values[1])) filter_owner = key_filter_new(values[1], &call.filter);
+
+  rb_iv_set(self, "@partly_read", Qfalse);
+  image_without_gvl(self, read_metadata_without_gvl, &call);
+  RB_GC_GUARD(filter_owner);
+  rb_iv_set(self, "@dirty", Qfalse);
+  image_allocated(self);
+
+  if (call.keep != all || call.filter) rb_iv_set(self, "@partly_read", Qtrue);
+
+  return Qnil;
+}
+
+static void write_metadata_without_gvl(Exiv2::Image* image) {
+  PhaseTimer timer(phase_write);
+  image->writeMetadata();
+  if (timer.enabled()) timer.add_bytes(image->io().size());
+}
+
+struct WriteToCall {
+  Exiv2::Image* image;
+  Exiv2::Image* copy; // The image with the metadata written, in memory.
+};
+
+// Write the image's metadata into a copy of it in memory, rather than back to wherever
+// it came from.
+static void write_to_without_gvl(WriteToCall* call) {
+  PhaseTimer timer(phase_write);
+  Exiv2::Image* image = call->image;
+  Exiv2::BasicIo::AutoPtr io(new Exiv2::MemIo);
+
+  Exiv2::BasicIo& source = image->io();
+  if (source.open() != 0)
+    throw Exiv2::Error(Exiv2::kerDataSourceOpenFailed, source.path(), Exiv2::strError());
+  Exiv2::IoCloser closer(source);
+  io->write(source);
+  closer.close();
+
+  Exiv2::Image::AutoPtr copy = Exiv2::ImageFactory::open(io);
+  copy->setMetadata(*image);
+  if (image->iccProfileDefined()) {
+    // setIccProfile takes the buffer it's given, so it gets a copy of ours.
+    Exiv2::DataBuf icc_profile(image->iccProfile()->pData_, image->iccProfile()->size_);
+    copy->setIccProfile(icc_profile, false);
+  }
+  copy->writeMetadata();
+  if (timer.enabled()) timer.add_bytes(copy->io().size());
+
+  call->copy = copy.release();
+}
+
+// Replace the contents of a string with the written image, or write it to an IO.
+static VALUE write_to_target(VALUE arg) {
+  VALUE* args = reinterpret_cast<VALUE*>(arg);
+  Exiv2::Image* copy = reinterpret_cast<Exiv2::Image*>(args[0]);
+  VALUE target = args[1];
+
+  Exiv2::BasicIo& io = copy->io();
+  const char* data = reinterpret_cast<const char*>(io.mmap());
+  long length = static_cast<long>(io.size());
+
+  if (RB_TYPE_P(target, T_STRING)) {
+    rb_str_modify(target);
+    rb_str_set_len(target, 0);
+    rb_str_cat(target, data, length);
+    rb_enc_associate(target, rb_ascii8bit_encoding());
+  }
+  else {
+    rb_funcall(target, id_write, 1, rb_str_new(data, length));
+  }
+
+  return target;
+}
+
+static VALUE write_to_ensure(VALUE arg) {
+  delete reinterpret_cast<Exiv2::Image*>(arg);
+  return Qnil;
+}
+
+static VALUE image_write_metadata(int argc, VALUE *argv, VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  VALUE options, values[1] = { Qundef };
+  rb_scan_args(argc, argv, "0:", &options);
+  if (!NIL_P(options)) rb_get_kwargs(options, write_metadata_options, 0, 1, values);
+
+  if (RTEST(rb_attr_get(self, rb_intern("@partly_read"))))
+    rb_raise(basic_error_class, "Can't write metadata that has only been partly read");
+
+  if (values[0] == Qundef || NIL_P(values[0])) {
+    if (!RTEST(image_dirty(self))) return Qnil; // Nothing to write.
+
+    image_without_gvl(self, write_metadata_without_gvl, image);
+    rb_iv_set(self, "@dirty", Qfalse);
+    return Qnil;
+  }
+
+  WriteToCall call = { image, NULL };
+  image_without_gvl(self, write_to_without_gvl, &call);
+
+  VALUE args[2] = { reinterpret_cast<VALUE>(call.copy), values[0] };
+  return rb_ensure(write_to_target, reinterpret_cast<VALUE>(args), write_to_ensure, reinterpret_cast<VALUE>(call.copy));
+}
+
+static VALUE image_exif_data(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  VALUE exif_data = TypedData_Wrap_Struct(exif_data_class, &exif_data_type, &image->exifData());
+  rb_ivar_set(exif_data, id_image, self);  // Make sure we don't GC the image until there are no references to the EXIF data left.
+
+  return exif_data;
+}
+
+static VALUE image_iptc_data(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  VALUE iptc_data = TypedData_Wrap_Struct(iptc_data_class, &iptc_data_type, &image->iptcData());
+  rb_ivar_set(iptc_data, id_image, self);  // Make sure we don't GC the image until there are no references to the IPTC data left.
+
+  return iptc_data;
+}
+
+
+static VALUE image_xmp_data(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  VALUE xmp_data = TypedData_Wrap_Struct(xmp_data_class, &xmp_data_type, &image->xmpData());
+  rb_ivar_set(xmp_data, id_image, self);  // Make sure we don't GC the image until there are no references to the XMP data left.
+
+  return xmp_data;
+}
+
+static VALUE image_copy_to_image(VALUE self, VALUE other) {
+  Exiv2::Image* image = get_image(self);
+  Exiv2::Image* other_image = get_image(other);
+
+  const Exiv2::Image &image_ref = *image;
+  other_image->setMetadata(image_ref);
+  image_changed(other);
+
+  return Qtrue;
+}
+
+static VALUE image_clear(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  if (!image->exifData().empty() || !image->iptcData().empty() || !image->xmpData().empty())
+    image_changed(self);
+
+  image->exifData().clear();
+  image->iptcData().clear();
+  image->xmpData().clear();
+
+  return Qtrue;
+}
+
+// Whether two lots of XMP data hold the same properties, with the same values, in order.
+static bool same_xmp_data(const Exiv2::XmpData& a, const Exiv2::XmpData& b) {
+  if (a.count() != b.count()) return false;
+
+  Exiv2::XmpData::const_iterator it = a.begin();
+  for (Exiv2::XmpData::const_iterator other = b.begin(); other != b.end(); it++, other++) {
+    if (it->key() != other->key() || it->typeId() != other->typeId() || it->toString() != other->toString())
+      return false;
+  }
+
+  return true;
+}
+
+// The packet is always decoded, since the one the image holds isn't kept up to date with
+// changes made to its XMP data; the image only counts as changed if the data do. A packet
+// that can't be decoded raises, leaving the data as they were.
+static VALUE image_set_xmp_packet(VALUE self, VALUE xmp_packet) {
+  Exiv2::Image* image = get_image(self);
+  std::string packet = to_std_string(xmp_packet);
+
+  bool changed = false;
+  VALUE error = Qnil;
+
+  {
+    Exiv2::XmpData before = image->xmpData();
+
+    try {
+      image->setXmpPacket(packet);
+      changed = !same_xmp_data(before, image->xmpData());
+    }
+    catch (Exiv2::AnyError& exiv2_error) {
+      image->setXmpData(before);
+      error = rb_exc_new_cstr(basic_error_class, exiv2_error.what()); // Raised once before has been freed.
+    }
+  }
+
+  if (!NIL_P(error)) rb_exc_raise(error);
+  if (changed) image_changed(self);
+  return Qtrue;
+}
+
+struct ScanXmpPacketCall {
+  Exiv2::Image* image;
+  std::string packet;
+};
+
+// Find the XMP packet in the image's bytes by looking for the <?xpacket?> processing
+// instructions that wrap it, which the XMP spec puts there so packets can be found in
+// files of any format without having to understand them.
+static void scan_xmp_packet_without_gvl(ScanXmpPacketCall* call) {
+  static const char begin[] = "<?xpacket begin=";
+  static const char end[] = "<?xpacket end=";
+  static const char close_pi[] = "?>";
+
+  Exiv2::BasicIo& io = call->image->io();
+  if (io.open() != 0)
+    throw Exiv2::Error(Exiv2::kerDataSourceOpenFailed, io.path(), Exiv2::strError());
+  Exiv2::IoCloser closer(io);
+
+  const char* data = reinterpret_cast<const char*>(io.mmap());
+  const char* data_end = data + io.size();
+
+  const char* packet = std::search(data, data_end, begin, begin + sizeof(begin) - 1);
+  if (packet == data_end) return;
+  const char* packet_end = std::search(packet, data_end, end, end + sizeof(end) - 1);
+  if (packet_end == data_end) return;
+  const char* close = std::search(packet_end, data_end, close_pi, close_pi + sizeof(close_pi) - 1);
+  if (close == data_end) return;
+
+  call->packet.assign(packet, close + sizeof(close_pi) - 1);
+}
+
+// The image's raw XMP packet, or nil if it doesn't have one. Normally that's the packet
+// read_metadata read, but with scan: true it's found in the image without reading (or
+// decoding) any of its metadata.
+static VALUE image_xmp_packet(int argc, VALUE *argv, VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  VALUE options, values[1] = { Qundef };
+  rb_scan_args(argc, argv, "0:", &options);
+  if (!NIL_P(options)) rb_get_kwargs(options, xmp_packet_options, 0, 1, values);
+
+  if (values[0] == Qundef || !RTEST(values[0]))
+    return image->xmpPacket().empty() ? Qnil : to_ruby_string(image->xmpPacket());
+
+  ScanXmpPacketCall call = { image, std::string() };
+  image_without_gvl(self, scan_xmp_packet_without_gvl, &call);
+
+  return call.packet.empty() ? Qnil : to_ruby_string(call.packet);
+}
+
+// Whether the image already has exactly this ICC profile.
+static bool image_has_same_icc_profile(Exiv2::Image* image, const Exiv2::DataBuf& icc_profile) {
+  Exiv2::DataBuf* current = image->iccProfile();
+
+  return image->iccProfileDefined() && current->size_ == icc_profile.size_ &&
+    std::memcmp(current->pData_, icc_profile.pData_, icc_profile.size_) == 0;
+}
+
+// Set the image's ICC profile from a file, or from an Exiv2::IccProfile (which saves
+// reading the same file over and over).
+static VALUE image_set_icc_profile(VALUE self, VALUE icc_profile) {
+  Exiv2::Image* image = get_image(self);
+
+  if (rb_typeddata_is_kind_of(icc_profile, &icc_profile_type)) {
+    Exiv2::DataBuf* shared;
+    TypedData_Get_Struct(icc_profile, Exiv2::DataBuf, &icc_profile_type, shared);
+
+    try {
+      if (!image_has_same_icc_profile(image, *shared)) {
+        Exiv2::DataBuf copy(shared->pData_, shared->size_); // setIccProfile takes the buffer it's given.
+        image->clearIccProfile();
+        image->setIccProfile(copy);
+        image_changed(self);
+      }
+    }
+    catch (const Exiv2::AnyError& error) {
+      rb_raise(basic_error_class, "%s", error.what());
+    }
+
+    return Qtrue;
+  }
+
+  try {
+    Exiv2::DataBuf icc_data = Exiv2::readFile(to_std_string(icc_profile));
+
+    if (!image_has_same_icc_profile(image, icc_data)) {
+      image->clearIccProfile();
+      image->setIccProfile(icc_data);
+      image_changed(self);
+    }
+  }
+  catch (const Exiv2::AnyError& error) {
+    rb_raise(basic_error_class, "%s", error.what());
+  }
+
+  return Qtrue;
+}
+
+// The image's ICC profile, as a frozen binary string, or nil if it doesn't have one.
+static VALUE image_icc_profile(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  if (!image->iccProfileDefined()) return Qnil;
+
+  Exiv2::DataBuf* icc_profile = image->iccProfile();
+  return rb_obj_freeze(rb_str_new(reinterpret_cast<const char*>(icc_profile->pData_), icc_profile->size_));
+}
+
+static VALUE image_has_icc_profile(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  if (image->iccProfileDefined())
+    return Qtrue;
+  else
+    return Qfalse;
+}
+
+static VALUE image_clear_icc_profile(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  if (image->iccProfileDefined()) image_changed(self);
+  image->clearIccProfile();
+
+  return Qtrue;
+}
+
+// Whether the image's metadata has been changed since it was last read or written. One
+// that hasn't been read yet is dirty, as writing it replaces whatever metadata it had.
+static VALUE image_dirty(VALUE self) {
+  return rb_attr_get(self, rb_intern("@dirty")) == Qfalse ? Qfalse : Qtrue;
+}
+
+
+// Previews embedded in the image (JPEG thumbnails in the Exif data, and the larger
+// previews in RAW files), found by Exiv2's PreviewManager from the metadata that's been
+// read, smallest first.
+
+struct PreviewsCall {
+  Exiv2::Image* image;
+  Exiv2::PreviewPropertiesList* properties;
+  long index;
+  Exiv2::PreviewImage* preview;
+};
+
+static void previews_without_gvl(PreviewsCall* call) {
+  Exiv2::PreviewManager manager(*call->image);
+  *call->properties = manager.getPreviewProperties();
+
+  if (call->index >= 0 && call->index < static_cast<long>(call->properties->size()))
+    call->preview = new Exiv2::PreviewImage(manager.getPreview((*call->properties)[call->index]));
+}
+
+static void preview_properties_free(void* properties) {
+  delete static_cast<Exiv2::PreviewPropertiesList*>(properties);
+}
+
+static const rb_data_type_t preview_properties_type = {
+  "Exiv2::PreviewPropertiesList", { 0, preview_properties_free, 0 }, 0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// The image's previews, as an array of Exiv2::PreviewProperties.
+static VALUE image_previews(VALUE self) {
+  Exiv2::Image* image = get_image(self);
+
+  Exiv2::PreviewPropertiesList* properties = new Exiv2::PreviewPropertiesList;
+  VALUE owner = TypedData_Wrap_Struct(0, &preview_properties_type, properties);
+
+  PreviewsCall call = { image, properties, -1, NULL };
+  image_without_gvl(self, previews_without_gvl, &call);
+
+  VALUE result = rb_ary_new_capa(properties->size());
+  for (size_t i = 0; i < properties->size(); i++) {
+    const Exiv2::PreviewProperties& preview = (*properties)[i];
+    rb_ary_push(result, rb_struct_new(preview_properties_class,
+      to_ruby_string(preview.mimeType_),
+      to_ruby_string(preview.extension_),
+      UINT2NUM(preview.size_),
+      preview.width_ > 0 ? UINT2NUM(preview.width_) : Qnil,
+      preview.height_ > 0 ? UINT2NUM(preview.height_) : Qnil));
+  }
+
+  RB_GC_GUARD(owner);
+  return result;
+}
+
+static VALUE preview_to_string(VALUE arg) {
+  Exiv2::PreviewImage* preview = reinterpret_cast<Exiv2::PreviewImage*>(arg);
+  return rb_str_new(reinterpret_cast<const char*>(preview->pData()), preview->size());
+}
+
+static VALUE preview_delete(VALUE arg) {
+  delete reinterpret_cast<Exiv2::PreviewImage*>(arg);
+  return Qnil;
+}
+
+// The bytes of one of the image's previews, by its index in previews, exactly as they're
+// stored in the image. Exiv2 extracts them into a buffer of its own, so they're copied
+// once more into the string.
+static VALUE image_preview_data(VALUE self, VALUE index) {
+  Exiv2::Image* image = get_image(self);
+
+  Exiv2::PreviewPropertiesList* properties = new Exiv2::PreviewPropertiesList;
+  VALUE owner = TypedData_Wrap_Struct(0, &preview_properties_type, properties);
+
+  PreviewsCall call = { image, properties, NUM2LONG(index), NULL };
+  image_without_gvl(self, previews_without_gvl, &call);
+  RB_GC_GUARD(owner);
+
+  if (!call.preview)
+    rb_raise(rb_eIndexError, "index %ld outside of %ld previews", call.index, static_cast<long>(properties->size()));
+
+  return rb_ensure(preview_to_string, reinterpret_cast<VALUE>(call.preview), preview_delete, reinterpret_cast<VALUE>(call.preview));
+}
+
+
+// Exiv2::IccProfile methods
+
+static void icc_profile_free(void* icc_profile) {
+  delete static_cast<Exiv2::DataBuf*>(icc_profile);
+}
+
+static size_t icc_profile_memsize(const void* icc_profile) {
+  return sizeof(Exiv2::DataBuf) + static_cast<const Exiv2::DataBuf*>(icc_profile)->size_;
+}
+
+static VALUE icc_profile_new(VALUE klass, VALUE data) {
+  StringValue(data);
+  Exiv2::DataBuf* icc_profile = new Exiv2::DataBuf(reinterpret_cast<const Exiv2::byte*>(RSTRING_PTR(data)), RSTRING_LEN(data));
+  return rb_obj_freeze(TypedData_Wrap_Struct(klass, &icc_profile_type, icc_profile));
+}
+
+static VALUE icc_profile_read(VALUE klass, VALUE path) {
+  Exiv2::DataBuf* icc_profile = new Exiv2::DataBuf;
+
+  try {
+    Exiv2::DataBuf data = Exiv2::readFile(to_std_string(path));
+    *icc_profile = data;
+  }
+  catch (const Exiv2::AnyError& error) {
+    delete icc_profile;
+    rb_raise(basic_error_class, "%s", error.what());
+  }
+
+  return rb_obj_freeze(TypedData_Wrap_Struct(klass, &icc_profile_type, icc_profile));
+}
+
+static VALUE icc_profile_size(VALUE self) {
+  Exiv2::DataBuf* icc_profile;
+  TypedData_Get_Struct(self, Exiv2::DataBuf, &icc_profile_type, icc_profile);
+
+  return LONG2NUM(icc_profile->size_);
+}
+
+static VALUE icc_profile_to_s(VALUE self) {
+  Exiv2::DataBuf* icc_profile;
+  TypedData_Get_Struct(self, Exiv2::DataBuf, &icc_profile_type, icc_profile);
+
+  return rb_str_new(reinterpret_cast<const char*>(icc_profile->pData_), icc_profile->size_);
+}
+
+
+// Exiv2::ImageFactory methods
+
+struct OpenCall {
+  const char* path;
+  long path_length;
+  bool mmap;
+  Exiv2::Image* image;
+};
+
+static void open_without_gvl(OpenCall* call) {
+  PhaseTimer timer(phase_open);
+  std::string path(call->path, call->path_length);
+  Exiv2::Image::AutoPtr image_auto_ptr;
+
+  if (call->mmap) {
+    Exiv2::BasicIo::AutoPtr io(new MappedFileIo(path));
+    image_auto_ptr = Exiv2::ImageFactory::open(io);
+  }
+  else {
+    image_auto_ptr = Exiv2::ImageFactory::open(path);
+  }
+
+  call->image = image_auto_ptr.release(); // Release the AutoPtr, so we can keep the image around.
+}
+
+static VALUE image_factory_open(int argc, VALUE *argv, VALUE klass) {
+  VALUE path, options, values[1] = { Qundef };
+  rb_scan_args(argc, argv, "1:", &path, &options);
+  if (!NIL_P(options)) rb_get_kwargs(options, open_options, 0, 1, values);
+
+  path = rb_str_new_frozen(StringValue(path)); // Nobody else can change it while we don't hold the GVL.
+
+  OpenCall call = { RSTRING_PTR(path), RSTRING_LEN(path), values[0] != Qundef && RTEST(values[0]), NULL };
+  without_gvl(open_without_gvl, &call);
+  RB_GC_GUARD(path);
+
+  return image_wrap(call.image);
+}
+
+struct OpenBufferCall {
+  VALUE buffer;
+  Exiv2::Image* image;
+};
+
+static void open_buffer_without_gvl(OpenBufferCall* call) {
+  PhaseTimer timer(phase_open);
+  Exiv2::BasicIo::AutoPtr io(new StringIo(call->buffer));
+  Exiv2::Image::AutoPtr image_auto_ptr = Exiv2::ImageFactory::open(io);
+  call->image = image_auto_ptr.release(); // Release the AutoPtr, so we can keep the image around.
+}
+
+static VALUE image_factory_open_buffer(VALUE klass, VALUE buffer) {
+  buffer = rb_str_new_frozen(StringValue(buffer)); // Shares the bytes with the original string, rather than copying them.
+
+  OpenBufferCall call = { buffer, NULL };
+  without_gvl(open_buffer_without_gvl, &call);
+  RB_GC_GUARD(buffer);
+
+  return image_wrap(call.image);
+}
+
+struct OpenIoCall {
+  VALUE io;
+  VALUE errors;
+  long size;
+  const char* path;
+  long path_length;
+  Exiv2::Image* image;
+};
+
+static void open_io_without_gvl(OpenIoCall* call) {
+  PhaseTimer timer(phase_open);
+  Exiv2::BasicIo::AutoPtr io(new RubyIo(call->io, call->errors, call->size, std::string(call->path, call->path_length)));
+  Exiv2::Image::AutoPtr image_auto_ptr = Exiv2::ImageFactory::open(io);
+  call->image = image_auto_ptr.release(); // Release the AutoPtr, so we can keep the image around.
+}
+
+static VALUE image_factory_open_io(VALUE klass, VALUE io) {
+  long size = NUM2LONG(rb_funcall(io, id_size, 0));
+  VALUE path = rb_str_new_frozen(rb_inspect(io));
+  VALUE errors = rb_ary_new();
+
+  OpenIoCall call = { io, errors, size, RSTRING_PTR(path), RSTRING_LEN(path), NULL };
+  without_gvl(open_io_without_gvl, &call);
+  RB_GC_GUARD(io);
+  RB_GC_GUARD(path);
+  RB_GC_GUARD(errors);
+
+  return image_wrap(call.image);
+}
+
+
+
+// The raw: option of each and to_hash.
+static bool parse_raw_option(int argc, VALUE *argv) {
+  VALUE options, values[1] = { Qundef };
+  rb_scan_args(argc, argv, "0:", &options);
+  if (!NIL_P(options)) rb_get_kwargs(options, conversion_options, 0, 1, values);
+
+  return values[0] != Qundef && RTEST(values[0]);
+}
+
+// Exiv2::Datum methods
+
+// What an Exiv2::Datum is looking at. each_datum yields the same one for every datum,
+// pointing it at each in turn, and points it at nothing once it's done.
+struct DatumView {
+  const Exiv2::Metadatum* datum;
+  const rb_encoding* encoding;
+  VALUE data; // Keeps the data (and so the image) alive while the datum is in use.
+};
+
+static void datum_mark(void* view) {
+  rb_gc_mark(static_cast<DatumView*>(view)->data);
+}
+
+static const Exiv2::Metadatum& get_datum(VALUE self) {
+  DatumView* view = static_cast<DatumView*>(rb_check_typeddata(self, &datum_type));
+  if (!view->datum)
+    rb_raise(rb_eRuntimeError, "datum used outside of each_datum");
+
+  return *view->datum;
+}
+
+static VALUE datum_key(VALUE self) {
+  return to_ruby_key(get_datum(self).key());
+}
+
+// The name Exiv2 gives the type of the datum's value, such as "Short" or "XmpBag".
+static VALUE datum_type_name(VALUE self) {
+  const char* name = get_datum(self).typeName();
+  return name ? to_ruby_key(name) : Qnil;
+}
+
+// The number of components in the datum's value.
+static VALUE datum_count(VALUE self) {
+  return LONG2NUM(get_datum(self).count());
+}
+
+// The size of the datum's value in bytes.
+static VALUE datum_size(VALUE self) {
+  return LONG2NUM(get_datum(self).size());
+}
+
+// The datum's value, converted the same way as by each, which only happens when asked for.
+static VALUE datum_value(int argc, VALUE *argv, VALUE self) {
+  bool raw = parse_raw_option(argc, argv);
+  const Exiv2::Metadatum& datum = get_datum(self);
+  const rb_encoding* encoding = static_cast<DatumView*>(DATA_PTR(self))->encoding;
+
+  ConvertTimer timer;
+  VALUE value = metadatum_to_ruby(datum, encoding, raw);
+  return value ? value : Qnil;
+}
+
+template <class T>
+struct EachDatum {
+  VALUE self;
+  VALUE handle;
+};
+
+template <class T>
+static VALUE each_datum_yield(VALUE arg) {
+  EachDatum<T>* each = reinterpret_cast<EachDatum<T>*>(arg);
+  DatumView* view = static_cast<DatumView*>(DATA_PTR(each->handle));
+  T* data = get_data<T>(each->self);
+
+  for (typename T::iterator it = data->begin(); it != data->end(); it++) {
+    view->datum = &*it;
+    rb_yield(each->handle);
+    get_data<T>(each->self); // The block can't have closed the image, but make sure.
+  }
+
+  return Qnil;
+}
+
+static VALUE each_datum_done(VALUE handle) {
+  static_cast<DatumView*>(DATA_PTR(handle))->datum = NULL;
+  return Qnil;
+}
+
+template <class T>
+static VALUE each_datum_run(VALUE arg) {
+  EachDatum<T>* each = reinterpret_cast<EachDatum<T>*>(arg);
+  return rb_ensure(each_datum_yield<T>, arg, each_datum_done, each->handle);
+}
+
+// Shared method for implementing each_datum on XmpData, IptcData and ExifData. Yields a
+// single Exiv2::Datum for each datum in turn, so walking the data only costs what's asked
+// of it, and it's only valid inside the block. Like each, the image is pinned meanwhile.
+template <class T>
+static VALUE metadata_each_datum(VALUE self, const rb_encoding *encoding = UTF_8) {
+  get_data<T>(self);
+
+  DatumView* view;
+  VALUE handle = TypedData_Make_Struct(datum_class, DatumView, &datum_type, view);
+  view->encoding = encoding;
+  view->data = self;
+
+  EachDatum<T> each = { self, handle };
+  with_data_pinned(self, each_datum_run<T>, reinterpret_cast<VALUE>(&each));
+
+  return self;
+}
+
+// Exiv2::ExifData methods
+
+static VALUE exif_data_each(int argc, VALUE *argv, VALUE self) {
+  bool raw = parse_raw_option(argc, argv);
+  return metadata_each<Exiv2::ExifData>(self, UTF_8, raw);
+}
+
+static VALUE exif_data_to_hash(int argc, VALUE *argv, VALUE self) {
+  bool raw = parse_raw_option(argc, argv);
+  return metadata_to_hash<Exiv2::ExifData>(self, UTF_8, raw);
+}
+
+static VALUE exif_data_aref(VALUE self, VALUE key) {
+  return metadata_aref<Exiv2::ExifData, Exiv2::ExifKey>(self, key);
+}
+
+static VALUE exif_data_values_at(int argc, VALUE *argv, VALUE self) {
+  return metadata_values_at<Exiv2::ExifData, Exiv2::ExifKey>(self, argc, argv);
+}
+
+static VALUE exif_data_each_datum(VALUE self) {
+  return metadata_each_datum<Exiv2::ExifData>(self);
+}
+
+static VALUE exif_data_keys(VALUE self) {
+  return metadata_keys<Exiv2::ExifData>(self);
+}
+
+static VALUE exif_data_has_key(VALUE self, VALUE key) {
+  return metadata_has_key<Exiv2::ExifData, Exiv2::ExifKey>(self, key);
+}
+
+static VALUE exif_data_size(VALUE self) {
+  return metadata_size<Exiv2::ExifData>(self);
+}
+
+static VALUE exif_data_select_group(VALUE self, VALUE group) {
+  return metadata_select_group<Exiv2::ExifData>(self, group, "Exif");
+}
+
+static VALUE exif_data_slice_prefix(VALUE self, VALUE prefix) {
+  return metadata_slice_prefix<Exiv2::ExifData>(self, prefix, "Exif");
+}
+
+static VALUE exif_data_add(VALUE self, VALUE key, VALUE value) {
+  Exiv2::ExifData* data = get_data<Exiv2::ExifData>(self);
+
+  ParsedKey<Exiv2::ExifKey> exifKey = parse_key_arg<Exiv2::ExifKey>(key);
+  Exiv2::Value::AutoPtr v = new_value(exifKey, value_to_std_string(value));
+
+  data->add(exifKey.key, v.get());
+  metadata_changed(self);
+  return Qtrue;
+}
+
+static VALUE exif_data_delete(VALUE self, VALUE key) {
+  Exiv2::ExifData* data = get_data<Exiv2::ExifData>(self);
+
+  Exiv2::ExifData::iterator pos = data->findKey(parse_key_arg<Exiv2::ExifKey>(key).key);
+  if(pos == data->end()) return Qfalse;
+  data->erase(pos);
+  metadata_changed(self);
+
+  return Qtrue;
+}
+
+static VALUE exif_data_delete_all(VALUE self, VALUE key) {
+  return metadata_delete_all<Exiv2::ExifData, Exiv2::ExifKey>(self, key);
+}
+
+static VALUE exif_data_clear(VALUE self) {
+  Exiv2::ExifData* data = get_data<Exiv2::ExifData>(self);
+
+  if (!data->empty()) metadata_changed(self);
+  data->clear();
+
+  return Qnil;
+}
+
+static VALUE exif_data_unchanged(VALUE self, VALUE key, VALUE values) {
+  return metadata_unchanged<Exiv2::ExifData, Exiv2::ExifKey>(self, key, values);
+}
+
+static VALUE exif_data_update(VALUE self, VALUE hash) {
+  return metadata_update<Exiv2::ExifData, Exiv2::ExifKey>(self, hash);
+}
+
+// Encode the data as a little-endian TIFF structure, as it would be stored in a JPEG's
+// APP1 segment, so it can be cached and turned back into data with from_blob.
+static VALUE exif_data_to_blob(VALUE self) {
+  Exiv2::ExifData* data = get_data<Exiv2::ExifData>(self);
+
+  VALUE result = Qnil, error = Qnil;
+
+  try {
+    Exiv2::Blob blob;
+    Exiv2::ExifParser::encode(blob, Exiv2::littleEndian, *data);
+    result = rb_str_new(blob.empty() ? NULL : reinterpret_cast<const char*>(&blob[0]), blob.size());
+  }
+  catch (Exiv2::AnyError& exiv2_error) {
+    error = rb_exc_new_cstr(basic_error_class, exiv2_error.what());
+  }
+
+  if (!NIL_P(error)) rb_exc_raise(error);
+  return result;
+}
+
+// Decode data encoded by to_blob (or any other TIFF structure). The data don't belong to
+// any image.
+static VALUE exif_data_from_blob(VALUE klass, VALUE blob) {
+  StringValue(blob);
+
+  Exiv2::ExifData* data = new Exiv2::ExifData;
+  VALUE result = TypedData_Wrap_Struct(klass, &own_exif_data_type, data);
+  VALUE error = Qnil;
+
+  try {
+    if (RSTRING_LEN(blob) > 0)
+      Exiv2::ExifParser::decode(*data, reinterpret_cast<const Exiv2::byte*>(RSTRING_PTR(blob)), RSTRING_LEN(blob));
+  }
+  catch (Exiv2::AnyError& exiv2_error) {
+    error = rb_exc_new_cstr(basic_error_class, exiv2_error.what());
+  }
+
+  if (!NIL_P(error)) rb_exc_raise(error);
+  RB_GC_GUARD(blob);
+  return result;
+}
+
+
+// Parse encoding from ISO 2022 encoding escape sequences, fall back to ISO 8859-1.
+
+struct IptcCharset {
+  const char *escape_sequence;
+  const char *encoding_name;
+  rb_encoding *encoding;
+};
+
+static IptcCharset iptc_charsets[] = {
+  { "\033%G",  "UTF-8",       NULL },
+  { "\033%/I", "UTF-8",       NULL },
+  { "\033%/L", "UTF-16",      NULL },
+  { "\033%/F", "UTF-32",      NULL },
+  { "\033(B",  "US-ASCII",    NULL },
+  { "\033.A",  "ISO-8859-1",  NULL },
+  { "\033.B",  "ISO-8859-2",  NULL },
+  { "\033.C",  "ISO-8859-3",  NULL },
+  { "\033.D",  "ISO-8859-4",  NULL },
+  { "\033.F",  "ISO-8859-7",  NULL },
+  { "\033.G",  "ISO-8859-6",  NULL },
+  { "\033.H",  "ISO-8859-8",  NULL },
+  { "\033/b",  "ISO-8859-15", NULL },
+};
+
+static void iptc_init_charsets() {
+  for (size_t i = 0; i < sizeof(iptc_charsets) / sizeof(iptc_charsets[0]); i++)
+    iptc_charsets[i].encoding = rb_enc_find(iptc_charsets[i].encoding_name);
+}
+
+static rb_encoding *iptc_parse_encoding(Exiv2::IptcData *data) {
+  Exiv2::IptcData::iterator pos = data->findId(Exiv2::IptcDataSets::CharacterSet, Exiv2::IptcDataSets::envelope);
+
+  if (pos != data->end() && pos->value().ok()) {
+    const std::string value = pos->toString();
+
+    for (size_t i = 0; i < sizeof(iptc_charsets) / sizeof(iptc_charsets[0]); i++) {
+      if (value == iptc_charsets[i].escape_sequence)
+        return iptc_charsets[i].encoding;
+    }
+  }
+
+  return ISO_8859_1;
+}
+
+// Exiv2::IptcData methods
+
+static VALUE iptc_data_each(int argc, VALUE *argv, VALUE self) {
+  bool raw = parse_raw_option(argc, argv);
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+  rb_encoding *encoding = iptc_parse_encoding(data);
+
+  return metadata_each<Exiv2::IptcData>(self, encoding, raw);
+}
+
+static VALUE iptc_data_to_hash(int argc, VALUE *argv, VALUE self) {
+  bool raw = parse_raw_option(argc, argv);
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+  rb_encoding *encoding = iptc_parse_encoding(data);
+
+  return metadata_to_hash<Exiv2::IptcData>(self, encoding, raw);
+}
+
+static VALUE iptc_data_aref(VALUE self, VALUE key) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+  rb_encoding *encoding = iptc_parse_encoding(data);
+
+  return metadata_aref<Exiv2::IptcData, Exiv2::IptcKey>(self, key, encoding);
+}
+
+static VALUE iptc_data_values_at(int argc, VALUE *argv, VALUE self) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+  rb_encoding *encoding = iptc_parse_encoding(data);
+
+  return metadata_values_at<Exiv2::IptcData, Exiv2::IptcKey>(self, argc, argv, encoding);
+}
+
+static VALUE iptc_data_each_datum(VALUE self) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+  rb_encoding *encoding = iptc_parse_encoding(data);
+
+  return metadata_each_datum<Exiv2::IptcData>(self, encoding);
+}
+
+static VALUE iptc_data_keys(VALUE self) {
+  return metadata_keys<Exiv2::IptcData>(self);
+}
+
+static VALUE iptc_data_has_key(VALUE self, VALUE key) {
+  return metadata_has_key<Exiv2::IptcData, Exiv2::IptcKey>(self, key);
+}
+
+static VALUE iptc_data_size(VALUE self) {
+  return metadata_size<Exiv2::IptcData>(self);
+}
+
+static VALUE iptc_data_select_group(VALUE self, VALUE group) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+  rb_encoding *encoding = iptc_parse_encoding(data);
+
+  return metadata_select_group<Exiv2::IptcData>(self, group, "Iptc", encoding);
+}
+
+static VALUE iptc_data_slice_prefix(VALUE self, VALUE prefix) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+  rb_encoding *encoding = iptc_parse_encoding(data);
+
+  return metadata_slice_prefix<Exiv2::IptcData>(self, prefix, "Iptc", encoding);
+}
+
+static VALUE iptc_data_add(VALUE self, VALUE key, VALUE value) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+
+  ParsedKey<Exiv2::IptcKey> iptcKey = parse_key_arg<Exiv2::IptcKey>(key);
+  Exiv2::Value::AutoPtr v = new_value(iptcKey, value_to_std_string(value));
+
+  if(data->add(iptcKey.key, v.get())) {
+    return Qfalse;
+  }
+  metadata_changed(self);
+  return Qtrue;
+}
+
+static VALUE iptc_data_delete(VALUE self, VALUE key) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+
+  Exiv2::IptcData::iterator pos = data->findKey(parse_key_arg<Exiv2::IptcKey>(key).key);
+  if(pos == data->end()) return Qfalse;
+  data->erase(pos);
+  metadata_changed(self);
+
+  return Qtrue;
+}
+
+static VALUE iptc_data_delete_all(VALUE self, VALUE key) {
+  return metadata_delete_all<Exiv2::IptcData, Exiv2::IptcKey>(self, key);
+}
+
+static VALUE iptc_data_clear(VALUE self) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+
+  if (!data->empty()) metadata_changed(self);
+  data->clear();
+
+  return Qnil;
+}
+
+static VALUE iptc_data_unchanged(VALUE self, VALUE key, VALUE values) {
+  return metadata_unchanged<Exiv2::IptcData, Exiv2::IptcKey>(self, key, values);
+}
+
+static VALUE iptc_data_update(VALUE self, VALUE hash) {
+  return metadata_update<Exiv2::IptcData, Exiv2::IptcKey>(self, hash);
+}
+
+// Encode the data as IPTC IIM datasets, as they would be stored in a Photoshop IRB, so
+// they can be cached and turned back into data with from_blob.
+static VALUE iptc_data_to_blob(VALUE self) {
+  Exiv2::IptcData* data = get_data<Exiv2::IptcData>(self);
+
+  VALUE result = Qnil, error = Qnil;
+
+  try {
+    Exiv2::DataBuf blob = Exiv2::IptcParser::encode(*data);
+    result = rb_str_new(reinterpret_cast<const char*>(blob.pData_), blob.size_);
+  }
+  catch (Exiv2::AnyError& exiv2_error) {
+    error = rb_exc_new_cstr(basic_error_class, exiv2_error.what());
+  }
+
+  if (!NIL_P(error)) rb_exc_raise(error);
+  return result;
+}
+
+// Decode data encoded by to_blob. The data don't belong to any image.
+static VALUE iptc_data_from_blob(VALUE klass, VALUE blob) {
+  StringValue(blob);
+
+  Exiv2::IptcData* data = new Exiv2::IptcData;
+  VALUE result = TypedData_Wrap_Struct(klass, &own_iptc_data_type, data);
+
+  if (RSTRING_LEN(blob) > 0 &&
+      Exiv2::IptcParser::decode(*data, reinterpret_cast<const Exiv2::byte*>(RSTRING_PTR(blob)), RSTRING_LEN(blob)) != 0)
+    rb_raise(basic_error_class, "Failed to decode IPTC data");
+
+  RB_GC_GUARD(blob);
+  return result;
+}
+
+// Exiv2::XmpData methods
+
+static VALUE xmp_data_each(int argc, VALUE *argv, VALUE self) {
+  bool raw = parse_raw_option(argc, argv);
+  return metadata_each<Exiv2::XmpData>(self, UTF_8, raw);
+}
 
-      case Exiv2::tiffFloat:
-      case Exiv2::tiffDouble: {
-        value = rb_float_new((double) val.toFloat(0));
-        break;
-      }
+static VALUE xmp_data_to_hash(int argc, VALUE *argv, VALUE self) {
+  bool raw = parse_raw_option(argc, argv);
+  return metadata_to_hash<Exiv2::XmpData>(self, UTF_8, raw);
+}
 
-      case Exiv2::date: {
-        value = rb_funcall(rb_path2class("Date"), rb_intern("parse"), 1, to_ruby_string(val.toString(0)));
-        break;
-      }
+static VALUE xmp_data_aref(VALUE self, VALUE key) {
+  return metadata_aref<Exiv2::XmpData, Exiv2::XmpKey>(self, key);
+}
 
-      case Exiv2::time: {
-        value = rb_funcall(rb_path2class("Time"), rb_intern("parse"), 1, to_ruby_string(val.toString(0)));
-        break;
-      }
+static VALUE xmp_data_values_at(int argc, VALUE *argv, VALUE self) {
+  return metadata_values_at<Exiv2::XmpData, Exiv2::XmpKey>(self, argc, argv);
+}
 
-      case Exiv2::unsignedRational: {
-        Exiv2::Rational rational = val.toRational(0);
-        value = rb_funcall(rb_mKernel, rb_intern("Rational"), 2, UINT2NUM(rational.first), UINT2NUM(rational.second));
-        break;
-      }
+static VALUE xmp_data_each_datum(VALUE self) {
+  return metadata_each_datum<Exiv2::XmpData>(self);
+}
 
-      case Exiv2::signedRational: {
-        Exiv2::Rational rational = val.toRational(0);
-        value = rb_funcall(rb_mKernel, rb_intern("Rational"), 2, INT2NUM(rational.first), INT2NUM(rational.second));
-        break;
-      }
+static VALUE xmp_data_keys(VALUE self) {
+  return metadata_keys<Exiv2::XmpData>(self);
+}
 
-      // TODO: this doesn't roundtrip yet
-      case Exiv2::langAlt: {
-        Exiv2::LangAltValue::ValueType values = static_cast<const Exiv2::LangAltValue &>(val).value_;
-        Exiv2::LangAltValue::ValueType::iterator first = values.begin();
-
-        if (n == 1 && first->first == "x-default") {
-          value = to_ruby_string(first->second, encoding);
-        } else {
-          /* value = rb_hash_new_capa(n); */
-          value = rb_hash_new();
-
-          for (Exiv2::LangAltValue::ValueType::iterator itv = values.begin(); itv != values.end(); itv++) {
-            VALUE lang = to_ruby_string(itv->first, encoding);
-            VALUE item = to_ruby_string(itv->second, encoding);
-            rb_hash_aset(value, lang, item);
-          }
-        }
-        break;
-     }
+static VALUE xmp_data_has_key(VALUE self, VALUE key) {
+  return metadata_has_key<Exiv2::XmpData, Exiv2::XmpKey>(self, key);
+}
 
-      case Exiv2::xmpBag:
-      case Exiv2::xmpSeq: {
-        value = rb_ary_new_capa(n);
+static VALUE xmp_data_size(VALUE self) {
+  return metadata_size<Exiv2::XmpData>(self);
+}
 
-        for (int i = 0; i < n; i++) {
-          VALUE item = to_ruby_string(val.toString(i), encoding);
-          rb_ary_push(value, item);
-        }
-        break;
-      }
+static VALUE xmp_data_select_group(VALUE self, VALUE group) {
+  return metadata_select_group<Exiv2::XmpData>(self, group, "Xmp");
+}
 
-      case Exiv2::undefined: {
-        value = to_ruby_string(val.toString(), encoding);
-        break;
-      }
+static VALUE xmp_data_slice_prefix(VALUE self, VALUE prefix) {
+  return metadata_slice_prefix<Exiv2::XmpData>(self, prefix, "Xmp");
+}
 
-      default: {
-        value = to_ruby_string(val.toString(0), encoding);
-        break;
-      }
-    }
+static VALUE xmp_data_add(VALUE self, VALUE key, VALUE value) {
+  Exiv2::XmpData* data = get_data<Exiv2::XmpData>(self);
 
-    if (value)
-      rb_yield(rb_ary_new3(2, key, value));
+  // Like (*data)[key] = value, but with the key from the cache.
+  ParsedKey<Exiv2::XmpKey> xmpKey = parse_key_arg<Exiv2::XmpKey>(key);
+  std::string string = value_to_std_string(value);
+
+  Exiv2::XmpData::iterator pos = data->findKey(xmpKey.key);
+  if (pos == data->end()) {
+    Exiv2::Value::AutoPtr v = new_value(xmpKey, string);
+    data->add(xmpKey.key, v.get());
+  }
+  else {
+    pos->setValue(string);
   }
+  metadata_changed(self);
 
-  return Qnil;
+  return Qtrue;
 }
 
-typedef VALUE (*Method)(...);
+static VALUE xmp_data_delete(VALUE self, VALUE key) {
+  Exiv2::XmpData* data = get_data<Exiv2::XmpData>(self);
 
-static VALUE exiv2_module;
+  Exiv2::XmpData::iterator pos = data->findKey(parse_key_arg<Exiv2::XmpKey>(key).key);
+  if(pos == data->end()) return Qfalse;
+  data->erase(pos);
+  metadata_changed(self);
 
-static VALUE basic_error_class;
+  return Qtrue;
+}
 
-static VALUE image_class;
-static void image_free(Exiv2::Image* image);
-static VALUE image_read_metadata(VALUE self);
-static VALUE image_write_metadata(VALUE self);
-static VALUE image_iptc_data(VALUE self);
-static VALUE image_xmp_data(VALUE self);
-static VALUE image_exif_data(VALUE self);
-static VALUE image_copy_to_image(VALUE self, VALUE other);
-static VALUE image_clear(VALUE self);
-static VALUE image_set_xmp_packet(VALUE self, VALUE xmp_packet);
-static VALUE image_set_icc_profile(VALUE self, VALUE icc_profile);
-static VALUE image_clear_icc_profile(VALUE self);
-static VALUE image_has_icc_profile(VALUE self);
+static VALUE xmp_data_delete_all(VALUE self, VALUE key) {
+  return metadata_delete_all<Exiv2::XmpData, Exiv2::XmpKey>(self, key);
+}
 
-static VALUE image_factory_class;
-static VALUE image_factory_open(VALUE klass, VALUE path);
+static VALUE xmp_data_clear(VALUE self) {
+  Exiv2::XmpData* data = get_data<Exiv2::XmpData>(self);
 
-static VALUE exif_data_class;
-static VALUE exif_data_each(VALUE self);
-static VALUE exif_data_add(VALUE self, VALUE key, VALUE value);
-static VALUE exif_data_delete(VALUE self, VALUE key);
-static VALUE exif_data_clear(VALUE self);
+  if (!data->empty()) metadata_changed(self);
+  data->clear();
 
-static VALUE iptc_data_class;
-static VALUE iptc_data_each(VALUE self);
-static VALUE iptc_data_add(VALUE self, VALUE key, VALUE value);
-static VALUE iptc_data_delete(VALUE self, VALUE key);
-static VALUE iptc_data_clear(VALUE self);
+  return Qnil;
+}
 
-static VALUE xmp_data_class;
-static VALUE xmp_data_each(VALUE self);
-static VALUE xmp_data_add(VALUE self, VALUE key, VALUE value);
-static VALUE xmp_data_delete(VALUE self, VALUE key);
-static VALUE xmp_data_clear(VALUE self);
+static VALUE xmp_data_unchanged(VALUE self, VALUE key, VALUE values) {
+  return metadata_unchanged<Exiv2::XmpData, Exiv2::XmpKey>(self, key, values);
+}
 
-extern "C" void Init_exiv2() {
-  VALUE enumerable_module = rb_const_get(rb_cObject, rb_intern("Enumerable"));
+static VALUE xmp_data_update(VALUE self, VALUE hash) {
+  return metadata_update<Exiv2::XmpData, Exiv2::XmpKey>(self, hash);
+}
 
-  exiv2_module = rb_define_module("Exiv2");
 
-  basic_error_class = rb_define_class_under(exiv2_module, "BasicError", rb_eRuntimeError);
+// Exiv2 module methods
 
-  image_class = rb_define_class_under(exiv2_module, "Image", rb_cObject);
-  rb_undef_alloc_func(image_class);
-  rb_define_method(image_class, "read_metadata", (Method)image_read_metadata, 0);
-  rb_define_method(image_class, "write_metadata", (Method)image_write_metadata, 0);
-  rb_define_method(image_class, "iptc_data", (Method)image_iptc_data, 0);
-  rb_define_method(image_class, "xmp_data", (Method)image_xmp_data, 0);
-  rb_define_method(image_class, "exif_data", (Method)image_exif_data, 0);
-  rb_define_method(image_class, "copy_to_image", (Method)image_copy_to_image, 1);
-  rb_define_method(image_class, "clear", (Method)image_clear, 0);
-  rb_define_method(image_class, "set_xmp_packet", (Method)image_set_xmp_packet, 1);
-  rb_define_method(image_class, "set_icc_profile", (Method)image_set_icc_profile, 1);
-  rb_define_method(image_class, "clear_icc_profile", (Method)image_clear_icc_profile, 0);
-  rb_define_method(image_class, "has_icc_profile?", (Method)image_has_icc_profile, 0);
+// Convert all of an image's metadata (or just the keys in filter) to a single hash.
+static VALUE image_metadata_to_hash(Exiv2::Image& image, const KeyFilter* filter) {
+  ConvertTimer timer;
+  rb_encoding *iptc_encoding = iptc_parse_encoding(&image.iptcData());
 
-  image_factory_class = rb_define_class_under(exiv2_module, "ImageFactory", rb_cObject);
-  rb_define_singleton_method(image_factory_class, "open", (Method)image_factory_open, 1);
+  if (!filter) {
+    VALUE result = hash_new_capa(image.exifData().count() + image.iptcData().count() + image.xmpData().count());
+    metadata_fill_hash(image.exifData(), result, UTF_8);
+    metadata_fill_hash(image.iptcData(), result, iptc_encoding);
+    metadata_fill_hash(image.xmpData(), result, UTF_8);
+    return result;
+  }
 
-  exif_data_class = rb_define_class_under(exiv2_module, "ExifData", rb_cObject);
-  rb_undef_alloc_func(exif_data_class);
-  rb_include_module(exif_data_class, enumerable_module);
-  rb_define_method(exif_data_class, "each", (Method)exif_data_each, 0);
-  rb_define_method(exif_data_class, "add", (Method)exif_data_add, 2);
-  rb_define_method(exif_data_class, "delete", (Method)exif_data_delete, 1);
-  rb_define_method(exif_data_class, "clear", (Method)exif_data_clear, 0);
+  long n = RARRAY_LEN(filter->names);
+  VALUE values = rb_ary_new_capa(n);
+  metadata_lookup(image.exifData(), filter->exif, filter->exif_indexes, values, UTF_8);
+  metadata_lookup(image.iptcData(), filter->iptc, filter->iptc_indexes, values, iptc_encoding);
+  metadata_lookup(image.xmpData(), filter->xmp, filter->xmp_indexes, values, UTF_8);
 
-  iptc_data_class = rb_define_class_under(exiv2_module, "IptcData", rb_cObject);
-  rb_undef_alloc_func(iptc_data_class);
-  rb_include_module(iptc_data_class, enumerable_module);
-  rb_define_method(iptc_data_class, "each", (Method)iptc_data_each, 0);
-  rb_define_method(iptc_data_class, "add", (Method)iptc_data_add, 2);
-  rb_define_method(iptc_data_class, "delete", (Method)iptc_data_delete, 1);
-  rb_define_method(iptc_data_class, "clear", (Method)iptc_data_clear, 0);
+  VALUE result = hash_new_capa(n);
+  for (long i = 0; i < n; i++) {
+    VALUE value = rb_ary_entry(values, i);
+    if (!NIL_P(value)) rb_hash_aset(result, rb_ary_entry(filter->names, i), value);
+  }
 
-  xmp_data_class = rb_define_class_under(exiv2_module, "XmpData", rb_cObject);
-  rb_undef_alloc_func(xmp_data_class);
-  rb_include_module(xmp_data_class, enumerable_module);
-  rb_define_method(xmp_data_class, "each", (Method)xmp_data_each, 0);
-  rb_define_method(xmp_data_class, "add", (Method)xmp_data_add, 2);
-  rb_define_method(xmp_data_class, "delete", (Method)xmp_data_delete, 1);
-  rb_define_method(xmp_data_class, "clear", (Method)xmp_data_clear, 0);
+  return result;
 }
 
+// Open and read an image on a batch worker, timing each like the Image methods do.
+static Exiv2::Image::AutoPtr batch_open(const std::string& path) {
+  PhaseTimer timer(phase_open);
+  return Exiv2::ImageFactory::open(path);
+}
 
-// Exiv2::Image Methods
+static void batch_read(Exiv2::Image& image) {
+  PhaseTimer timer(phase_read);
+  image.readMetadata();
+  if (timer.enabled()) timer.add_bytes(image.io().size());
+}
 
-static void image_free(Exiv2::Image* image) {
-  delete image;
+// Reads an image for read_many. If there's a key filter, everything else is dropped right
+// away, rather than taking up memory while the image waits to be converted.
+static void read_many_process(BatchItem& item, const std::string& path, void* filter) {
+  Exiv2::Image::AutoPtr image = batch_open(path);
+  batch_read(*image);
+  if (filter) image_apply_key_filter(*image, *static_cast<KeyFilter*>(filter));
+  item.image = image.release();
 }
 
-static VALUE image_read_metadata(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+struct ReadManyCall {
+  VALUE paths;
+  VALUE threads;
+  VALUE keys;
+  VALUE filter_owner;
+  KeyFilter* filter;
+  Batch* batch;
+};
 
-  try {
-    image->readMetadata();
-  }
-  catch (Exiv2::BasicError<char> error) {
-    rb_raise(basic_error_class, "%s", error.what());
-  }
+static VALUE read_many_body(VALUE arg) {
+  ReadManyCall* call = reinterpret_cast<ReadManyCall*>(arg);
 
-  return Qnil;
-}
+  int threads = NUM2INT(call->threads);
+  if (threads < 1) rb_raise(rb_eArgError, "threads must be at least 1");
 
-static VALUE image_write_metadata(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+  if (!NIL_P(call->keys))
+    call->filter_owner = key_filter_new(call->keys, &call->filter);
 
-  try {
-    image->writeMetadata();
+  call->batch = new Batch(read_many_process, call->filter);
+  for (long i = 0; i < RARRAY_LEN(call->paths); i++) {
+    VALUE path = rb_ary_entry(call->paths, i);
+    call->batch->add(to_std_string(FilePathValue(path)));
   }
-  catch (Exiv2::BasicError<char> error) {
-    rb_raise(basic_error_class, "%s", error.what());
+
+  if (call->batch->size() == 0) return Qnil;
+  if (!call->batch->start(threads))
+    rb_raise(basic_error_class, "couldn't start any threads to read images on");
+
+  while (call->batch->next()) {
+    BatchItem& item = call->batch->current();
+    VALUE path = rb_ary_entry(call->paths, item.index);
+
+    if (item.failed)
+      rb_yield_values(3, path, Qnil, rb_exc_new(basic_error_class, item.error.data(), item.error.length()));
+    else
+      rb_yield_values(3, path, image_metadata_to_hash(*item.image, call->filter), Qnil);
   }
 
   return Qnil;
 }
 
-static VALUE image_exif_data(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+static VALUE read_many_ensure(VALUE arg) {
+  ReadManyCall* call = reinterpret_cast<ReadManyCall*>(arg);
 
-  VALUE exif_data = Data_Wrap_Struct(exif_data_class, 0, 0, &image->exifData());
-  rb_iv_set(exif_data, "@image", self);  // Make sure we don't GC the image until there are no references to the EXIF data left.
+  delete call->batch; // Stops and waits for the workers, if we didn't get through all the images.
 
-  return exif_data;
+  return Qnil;
 }
 
-static VALUE image_iptc_data(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+static VALUE exiv2_read_many(VALUE self, VALUE paths, VALUE threads, VALUE keys) {
+  ReadManyCall call = { rb_ary_dup(rb_convert_type(paths, T_ARRAY, "Array", "to_ary")), threads, keys, Qnil, NULL, NULL };
 
-  VALUE iptc_data = Data_Wrap_Struct(iptc_data_class, 0, 0, &image->iptcData());
-  rb_iv_set(iptc_data, "@image", self);  // Make sure we don't GC the image until there are no references to the IPTC data left.
+  rb_ensure(read_many_body, reinterpret_cast<VALUE>(&call), read_many_ensure, reinterpret_cast<VALUE>(&call));
+  RB_GC_GUARD(call.paths);
+  RB_GC_GUARD(call.filter_owner);
 
-  return iptc_data;
+  return Qnil;
 }
 
+// Patches an image for write_many, only writing it if that changed anything.
+static void write_many_process(BatchItem& item, const std::string& path, void* context) {
+  const WritePatch& patch = *static_cast<WritePatch*>(context);
 
-static VALUE image_xmp_data(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+  Exiv2::Image::AutoPtr image = batch_open(path);
+  batch_read(*image);
 
-  VALUE xmp_data = Data_Wrap_Struct(xmp_data_class, 0, 0, &image->xmpData());
-  rb_iv_set(xmp_data, "@image", self);  // Make sure we don't GC the image until there are no references to the XMP data left.
+  bool exif_changed = update_apply(image->exifData(), patch.exif);
+  bool iptc_changed = update_apply(image->iptcData(), patch.iptc);
+  bool xmp_changed = update_apply(image->xmpData(), patch.xmp);
 
-  return xmp_data;
+  item.changed = exif_changed || iptc_changed || xmp_changed;
+  if (item.changed) write_metadata_without_gvl(image.get());
 }
 
-static VALUE image_copy_to_image(VALUE self, VALUE other) {
-  Exiv2::Image *image, *other_image;
-  Data_Get_Struct(self,  Exiv2::Image, image);
-  Data_Get_Struct(other, Exiv2::Image, other_image);
+struct WriteManyCall {
+  VALUE paths;
+  VALUE threads;
+  VALUE exif;
+  VALUE iptc;
+  VALUE xmp;
+  VALUE patch_owner;
+  WritePatch* patch;
+  Batch* batch;
+};
+
+static VALUE write_many_body(VALUE arg) {
+  WriteManyCall* call = reinterpret_cast<WriteManyCall*>(arg);
+
+  int threads = NUM2INT(call->threads);
+  if (threads < 1) rb_raise(rb_eArgError, "threads must be at least 1");
+
+  call->patch_owner = write_patch_new(call->exif, call->iptc, call->xmp, &call->patch);
+
+  call->batch = new Batch(write_many_process, call->patch);
+  for (long i = 0; i < RARRAY_LEN(call->paths); i++) {
+    VALUE path = rb_ary_entry(call->paths, i);
+    call->batch->add(to_std_string(FilePathValue(path)));
+  }
 
-  const Exiv2::Image &image_ref = *image;
-  other_image->setMetadata(image_ref);
+  if (call->batch->size() == 0) return Qnil;
+  if (!call->batch->start(threads))
+    rb_raise(basic_error_class, "couldn't start any threads to write images on");
 
-  return Qtrue;
+  while (call->batch->next()) {
+    BatchItem& item = call->batch->current();
+    VALUE path = rb_ary_entry(call->paths, item.index);
+
+    if (item.failed)
+      rb_yield_values(3, path, Qnil, rb_exc_new(basic_error_class, item.error.data(), item.error.length()));
+    else
+      rb_yield_values(3, path, item.changed ? Qtrue : Qfalse, Qnil);
+  }
+
+  return Qnil;
 }
 
-static VALUE image_clear(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+static VALUE write_many_ensure(VALUE arg) {
+  WriteManyCall* call = reinterpret_cast<WriteManyCall*>(arg);
 
-  image->exifData().clear();
-  image->iptcData().clear();
-  image->xmpData().clear();
+  delete call->batch; // Stops and waits for the workers, so none of them are left using the patch.
 
-  return Qtrue;
+  return Qnil;
 }
 
-static VALUE image_set_xmp_packet(VALUE self, VALUE xmp_packet) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+static VALUE exiv2_write_many(VALUE self, VALUE paths, VALUE threads, VALUE exif, VALUE iptc, VALUE xmp) {
+  WriteManyCall call = { rb_ary_dup(rb_convert_type(paths, T_ARRAY, "Array", "to_ary")), threads, exif, iptc, xmp, Qnil, NULL, NULL };
 
-  image->setXmpPacket(to_std_string(xmp_packet));
+  rb_ensure(write_many_body, reinterpret_cast<VALUE>(&call), write_many_ensure, reinterpret_cast<VALUE>(&call));
+  RB_GC_GUARD(call.paths);
+  RB_GC_GUARD(call.patch_owner);
 
-  return Qtrue;
+  return Qnil;
 }
 
-static VALUE image_set_icc_profile(VALUE self, VALUE icc_path) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
-
-  try {
-    Exiv2::DataBuf icc_profile = Exiv2::readFile(to_std_string(icc_path));
-    image->clearIccProfile();
-    image->setIccProfile(icc_profile);
+// The counters for each phase, as a hash of hashes keyed by the phase's name.
+static VALUE exiv2_stats(VALUE self) {
+  static const char* names[phase_count] = { "open", "read", "convert", "write" };
+  VALUE result = rb_hash_new();
+
+  for (int p = 0; p < phase_count; p++) {
+    PhaseStats& stats = phase_stats[p];
+    VALUE phase = rb_hash_new();
+    rb_hash_aset(phase, ID2SYM(rb_intern("calls")), ULL2NUM(stats.calls.load(std::memory_order_relaxed)));
+    rb_hash_aset(phase, ID2SYM(rb_intern("total_ns")), ULL2NUM(stats.total_ns.load(std::memory_order_relaxed)));
+    rb_hash_aset(phase, ID2SYM(rb_intern("max_ns")), ULL2NUM(stats.max_ns.load(std::memory_order_relaxed)));
+    rb_hash_aset(phase, ID2SYM(rb_intern("bytes")), ULL2NUM(stats.bytes.load(std::memory_order_relaxed)));
+    rb_hash_aset(phase, ID2SYM(rb_intern("objects")), ULL2NUM(stats.objects.load(std::memory_order_relaxed)));
+    rb_hash_aset(phase, ID2SYM(rb_intern("values")), ULL2NUM(stats.values.load(std::memory_order_relaxed)));
+    rb_hash_aset(result, ID2SYM(rb_intern(names[p])), phase);
   }
-  catch (Exiv2::BasicError<char> error) {
-    rb_raise(basic_error_class, "%s", error.what());
+
+  return result;
+}
+
+static VALUE exiv2_reset_stats(VALUE self) {
+  for (int p = 0; p < phase_count; p++) {
+    PhaseStats& stats = phase_stats[p];
+    stats.calls.store(0, std::memory_order_relaxed);
+    stats.total_ns.store(0, std::memory_order_relaxed);
+    stats.max_ns.store(0, std::memory_order_relaxed);
+    stats.bytes.store(0, std::memory_order_relaxed);
+    stats.objects.store(0, std::memory_order_relaxed);
+    stats.values.store(0, std::memory_order_relaxed);
   }
 
-  return Qtrue;
+  return Qnil;
 }
 
-static VALUE image_has_icc_profile(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+static VALUE exiv2_stats_enabled(VALUE self) {
+  return stats_enabled.load(std::memory_order_relaxed) ? Qtrue : Qfalse;
+}
 
-  if (image->iccProfileDefined())
-    return Qtrue;
+static VALUE exiv2_set_stats_enabled(VALUE self, VALUE enabled) {
+  stats_enabled.store(RTEST(enabled), std::memory_order_relaxed);
+  return enabled;
+}
+
+// A column of values being filled in by extract, one row for each path. Numbers are
+// packed straight into data, and strings kept until the end, when they're concatenated
+// with their offsets. Rows are valid only if their bit in validity is set.
+struct ExtractColumn {
+  ColumnType type;
+  std::string data;
+  std::vector<std::string> strings;
+  std::string validity;
+};
+
+// The column type for a key, if it isn't given: the type of its Exiv2 default type.
+static ColumnType default_column_type(const std::string& name) {
+  Exiv2::TypeId type;
+  if (starts_with(name, "Iptc."))
+    type = parse_key<Exiv2::IptcKey>(name).type;
+  else if (starts_with(name, "Xmp."))
+    type = parse_key<Exiv2::XmpKey>(name).type;
   else
-    return Qfalse;
+    type = parse_key<Exiv2::ExifKey>(name).type;
+
+  switch (type) {
+    case Exiv2::unsignedByte:
+    case Exiv2::unsignedShort:
+    case Exiv2::unsignedLong:
+    case Exiv2::unsignedLongLong:
+    case Exiv2::signedByte:
+    case Exiv2::signedShort:
+    case Exiv2::signedLong:
+    case Exiv2::signedLongLong:
+    case Exiv2::tiffIfd:
+    case Exiv2::tiffIfd8:
+      return column_int64;
+
+    case Exiv2::unsignedRational:
+    case Exiv2::signedRational:
+    case Exiv2::tiffFloat:
+    case Exiv2::tiffDouble:
+      return column_float64;
+
+    default:
+      return column_string;
+  }
 }
 
-static VALUE image_clear_icc_profile(VALUE self) {
-  Exiv2::Image* image;
-  Data_Get_Struct(self, Exiv2::Image, image);
+static ColumnType parse_column_type(VALUE type, VALUE name) {
+  if (NIL_P(type)) return default_column_type(to_std_string(name));
 
-  image->clearIccProfile();
+  for (size_t t = 0; t < sizeof(column_types) / sizeof(column_types[0]); t++) {
+    if (SYMBOL_P(type) && SYM2ID(type) == column_types[t].id)
+      return column_types[t].type;
+  }
 
-  return Qtrue;
+  rb_raise(rb_eArgError, "unknown type of column: %" PRIsVALUE, rb_inspect(type));
 }
 
+// Store a datum's value in a row of a column. Only the first component of a value with
+// more than one is used, and values that can't be converted to the column's type are
+// left as nulls.
+static void extract_cell(ExtractColumn& column, size_t row, const Exiv2::Metadatum& datum) {
+  if (datum.count() == 0) return;
+  const Exiv2::Value& value = datum.value();
+
+  switch (column.type) {
+    case column_int64: {
+      int64_t number = value.toLong(0);
+      if (!value.ok()) return;
+      memcpy(&column.data[row * sizeof(number)], &number, sizeof(number));
+      break;
+    }
 
-// Exiv2::ImageFactory methods
-
-static VALUE image_factory_open(VALUE klass, VALUE path) {
-  Exiv2::Image* image;
+    case column_float64: {
+      double number;
+      if (datum.typeId() == Exiv2::unsignedRational || datum.typeId() == Exiv2::signedRational) {
+        Exiv2::Rational rational = value.toRational(0);
+        if (!value.ok() || rational.second == 0) return;
+        number = datum.typeId() == Exiv2::unsignedRational
+          ? static_cast<double>(static_cast<uint32_t>(rational.first)) / static_cast<uint32_t>(rational.second)
+          : static_cast<double>(rational.first) / rational.second;
+      }
+      else {
+        number = value.toFloat(0);
+        if (!value.ok()) return;
+      }
+      memcpy(&column.data[row * sizeof(number)], &number, sizeof(number));
+      break;
+    }
 
-  try {
-    Exiv2::Image::AutoPtr image_auto_ptr = Exiv2::ImageFactory::open(to_std_string(path));
-    image = image_auto_ptr.release(); // Release the AutoPtr, so we can keep the image around.
-  }
-  catch (Exiv2::BasicError<char> error) {
-    rb_raise(basic_error_class, "%s", error.what());
+    case column_string: {
+      column.strings[row] = value.toString(0);
+      break;
+    }
   }
 
-  return Data_Wrap_Struct(image_class, 0, image_free, image);
+  column.validity[row / 8] |= static_cast<char>(1 << (row % 8));
 }
 
+// Fill in a row of each of the columns for one family's keys, from the first datum with
+// each key. The data has already been filtered down to the keys.
+template <class T, class K>
+static void extract_row(T& data, const std::vector<K>& keys, const std::vector<long>& indexes, std::vector<ExtractColumn>& columns, size_t row) {
+  for (size_t k = 0; k < keys.size(); k++) {
+    for (typename T::iterator it = data.begin(); it != data.end(); it++) {
+      if (!key_matches(*it, keys[k])) continue;
 
-// Exiv2::ExifData methods
-
-static VALUE exif_data_each(VALUE self) {
-  return metadata_each<Exiv2::ExifData>(self);
+      extract_cell(columns[indexes[k]], row, *it);
+      break;
+    }
+  }
 }
 
-static VALUE exif_data_add(VALUE self, VALUE key, VALUE value) {
-  Exiv2::ExifData* data;
-  Data_Get_Struct(self, Exiv2::ExifData, data);
-
-  Exiv2::ExifKey exifKey = Exiv2::ExifKey(to_std_string(key));
+// Turn a finished column into an Exiv2::Column.
+static VALUE extract_column_to_ruby(ExtractColumn& column, size_t rows) {
+  long valid = 0;
+  for (size_t i = 0; i < column.validity.size(); i++) {
+    for (unsigned char bits = column.validity[i]; bits; bits &= bits - 1) valid++;
+  }
 
-#if EXIV2_MAJOR_VERSION <= 0 && EXIV2_MINOR_VERSION <= 20
-  Exiv2::TypeId typeId = Exiv2::ExifTags::tagType(exifKey.tag(), exifKey.ifdId());
-#else
-  Exiv2::TypeId typeId = exifKey.defaultTypeId();
-#endif
+  VALUE type = ID2SYM(column_types[column.type].id);
+  VALUE offsets = Qnil;
 
-  Exiv2::Value::AutoPtr v = Exiv2::Value::create(typeId);
-  v->read(value_to_std_string(value));
+  if (column.type == column_string) {
+    size_t length = 0;
+    for (size_t row = 0; row < rows; row++) length += column.strings[row].length();
+    if (length > INT32_MAX)
+      rb_raise(rb_eRangeError, "strings in a column are more than 2GB");
 
-  data->add(exifKey, v.get());
-  return Qtrue;
-}
+    std::string packed(sizeof(int32_t) * (rows + 1), '\0');
+    int32_t offset = 0;
+    column.data.reserve(length);
 
-static VALUE exif_data_delete(VALUE self, VALUE key) {
-  Exiv2::ExifData* data;
-  Data_Get_Struct(self, Exiv2::ExifData, data);
+    for (size_t row = 0; row < rows; row++) {
+      column.data += column.strings[row];
+      std::string().swap(column.strings[row]);
+      offset = static_cast<int32_t>(column.data.length());
+      memcpy(&packed[sizeof(int32_t) * (row + 1)], &offset, sizeof(offset));
+    }
 
-  Exiv2::ExifKey exifKey = Exiv2::ExifKey(to_std_string(key));
-  Exiv2::ExifData::iterator pos = data->findKey(exifKey);
-  if(pos == data->end()) return Qfalse;
-  data->erase(pos);
+    offsets = rb_str_new(packed.data(), packed.length());
+  }
 
-  return Qtrue;
+  return rb_struct_new(column_class,
+    type,
+    SIZET2NUM(rows),
+    rb_str_new(column.data.data(), column.data.length()),
+    offsets,
+    rb_str_new(column.validity.data(), column.validity.length()),
+    LONG2NUM(static_cast<long>(rows) - valid));
 }
 
-static VALUE exif_data_clear(VALUE self) {
-  Exiv2::ExifData* data;
-  Data_Get_Struct(self, Exiv2::ExifData, data);
+struct ExtractCall {
+  VALUE paths;
+  VALUE threads;
+  VALUE keys;
+  VALUE types;
+  VALUE filter_owner;
+  KeyFilter* filter;
+  Batch* batch;
+  std::vector<ExtractColumn>* columns;
+};
+
+static VALUE extract_body(VALUE arg) {
+  ExtractCall* call = reinterpret_cast<ExtractCall*>(arg);
+
+  int threads = NUM2INT(call->threads);
+  if (threads < 1) rb_raise(rb_eArgError, "threads must be at least 1");
+
+  call->filter_owner = key_filter_new(call->keys, &call->filter);
+  size_t rows = RARRAY_LEN(call->paths);
+  long n = RARRAY_LEN(call->filter->names);
+
+  call->columns = new std::vector<ExtractColumn>(n);
+  for (long i = 0; i < n; i++) {
+    ExtractColumn& column = (*call->columns)[i];
+    column.type = parse_column_type(rb_ary_entry(call->types, i), rb_ary_entry(call->filter->names, i));
+    column.validity.assign((rows + 7) / 8, '\0');
+    if (column.type == column_string)
+      column.strings.resize(rows);
+    else
+      column.data.assign(rows * 8, '\0');
+  }
 
-  data->clear();
+  VALUE errors = rb_hash_new();
 
-  return Qnil;
-}
+  call->batch = new Batch(read_many_process, call->filter);
+  for (size_t i = 0; i < rows; i++) {
+    VALUE path = rb_ary_entry(call->paths, i);
+    call->batch->add(to_std_string(FilePathValue(path)));
+  }
 
+  if (rows > 0 && !call->batch->start(threads))
+    rb_raise(basic_error_class, "couldn't start any threads to read images on");
 
-// Parse encoding from ISO 2022 encoding escape sequences, fall back to ISO 8859-1.
+  while (rows > 0 && call->batch->next()) {
+    BatchItem& item = call->batch->current();
 
-static rb_encoding *iptc_parse_encoding(Exiv2::IptcData *data) {
-  Exiv2::IptcData::iterator pos = data->findKey(Exiv2::IptcKey("Iptc.Envelope.CharacterSet"));
-  rb_encoding *encoding = rb_enc_find("ISO-8859-1");
+    if (item.failed) {
+      rb_hash_aset(errors, rb_ary_entry(call->paths, item.index), rb_exc_new(basic_error_class, item.error.data(), item.error.length()));
+      continue;
+    }
 
-  if (pos != data->end()) {
-    const std::string value = pos->toString();
+    extract_row(item.image->exifData(), call->filter->exif, call->filter->exif_indexes, *call->columns, item.index);
+    extract_row(item.image->iptcData(), call->filter->iptc, call->filter->iptc_indexes, *call->columns, item.index);
+    extract_row(item.image->xmpData(), call->filter->xmp, call->filter->xmp_indexes, *call->columns, item.index);
+  }
+
+  VALUE columns = hash_new_capa(n);
+  for (long i = 0; i < n; i++)
+    rb_hash_aset(columns, rb_ary_entry(call->filter->names, i), extract_column_to_ruby((*call->columns)[i], rows));
 
-    if (pos->value().ok()) {
-      if      (value == "\033%G" || value == "\033%/I")
-        encoding = UTF_8;
-      else if (value == "\033%/L")
-        encoding = rb_enc_find("UTF-16");
-      else if (value == "\033%/F")
-        encoding = rb_enc_find("UTF-32");
-      else if (value == "\033(B")
-        encoding = rb_enc_find("US-ASCII");
-      else if (value == "\033.A")
-        encoding = rb_enc_find("ISO-8859-1");
-      else if (value == "\033.B")
-        encoding = rb_enc_find("ISO-8859-2");
-      else if (value == "\033.C")
-        encoding = rb_enc_find("ISO-8859-3");
-      else if (value == "\033.D")
-        encoding = rb_enc_find("ISO-8859-4");
-      else if (value == "\033.F")
-        encoding = rb_enc_find("ISO-8859-7");
-      else if (value == "\033.G")
-        encoding = rb_enc_find("ISO-8859-6");
-      else if (value == "\033.H")
-        encoding = rb_enc_find("ISO-8859-8");
-      else if (value == "\033/b")
-        encoding = rb_enc_find("ISO-8859-15");
-    }
-  }
-
-  return encoding;
+  return rb_struct_new(extraction_class, SIZET2NUM(rows), columns, errors);
 }
 
-// Exiv2::IptcData methods
+static VALUE extract_ensure(VALUE arg) {
+  ExtractCall* call = reinterpret_cast<ExtractCall*>(arg);
 
-static VALUE iptc_data_each(VALUE self) {
-  Exiv2::IptcData* data;
-  Data_Get_Struct(self, Exiv2::IptcData, data);
-  rb_encoding *encoding = iptc_parse_encoding(data);
+  delete call->batch;
+  delete call->columns;
 
-  return metadata_each<Exiv2::IptcData>(self, encoding);
+  return Qnil;
 }
 
-static VALUE iptc_data_add(VALUE self, VALUE key, VALUE value) {
-  Exiv2::IptcData* data;
-  Data_Get_Struct(self, Exiv2::IptcData, data);
+// Read the same keys from many images into a column for each, using the same workers as
+// read_many. Only the columns are Ruby objects, however many images there are.
+static VALUE exiv2_extract(VALUE self, VALUE paths, VALUE threads, VALUE keys, VALUE types) {
+  ExtractCall call = { rb_ary_dup(rb_convert_type(paths, T_ARRAY, "Array", "to_ary")), threads, keys, types, Qnil, NULL, NULL, NULL };
 
-  Exiv2::IptcKey iptcKey  = Exiv2::IptcKey(to_std_string(key));
-  Exiv2::TypeId typeId    = Exiv2::IptcDataSets::dataSetType(iptcKey.tag(), iptcKey.record());
+  VALUE result = rb_ensure(extract_body, reinterpret_cast<VALUE>(&call), extract_ensure, reinterpret_cast<VALUE>(&call));
+  RB_GC_GUARD(call.paths);
+  RB_GC_GUARD(call.filter_owner);
 
-  Exiv2::Value::AutoPtr v = Exiv2::Value::create(typeId);
-  v->read(value_to_std_string(value));
+  return result;
+}
 
-  if(data->add(iptcKey, v.get())) {
-    return Qfalse;
+// Read the pixel dimensions from the frame header of a JPEG, which is usually in the first
+// few hundred bytes.
+static bool jpeg_dimensions(Exiv2::BasicIo& io, int& width, int& height) {
+  Exiv2::byte buf[5];
+  if (io.seek(2, Exiv2::BasicIo::beg) != 0) return false; // Skip the SOI marker.
+
+  for (;;) {
+    if (io.read(buf, 1) != 1 || buf[0] != 0xff) return false;
+    do {
+      if (io.read(buf, 1) != 1) return false;
+    } while (buf[0] == 0xff); // Skip fill bytes.
+
+    int marker = buf[0];
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) continue; // Markers without a segment.
+    if (marker == 0xd9 || marker == 0xda) return false; // End of image, or image data before a frame header.
+
+    if (io.read(buf, 2) != 2) return false;
+    long length = Exiv2::getUShort(buf, Exiv2::bigEndian);
+    if (length < 2) return false;
+
+    // SOF0 to SOF15, apart from DHT, JPG and DAC.
+    if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+      if (length < 7 || io.read(buf, 5) != 5) return false;
+      height = Exiv2::getUShort(buf + 1, Exiv2::bigEndian);
+      width  = Exiv2::getUShort(buf + 3, Exiv2::bigEndian);
+      return true;
+    }
+
+    if (io.seek(length - 2, Exiv2::BasicIo::cur) != 0) return false;
   }
-  return Qtrue;
 }
 
-static VALUE iptc_data_delete(VALUE self, VALUE key) {
-  Exiv2::IptcData* data;
-  Data_Get_Struct(self, Exiv2::IptcData, data);
-
-  Exiv2::IptcKey iptcKey = Exiv2::IptcKey(to_std_string(key));
-  Exiv2::IptcData::iterator pos = data->findKey(iptcKey);
-  if(pos == data->end()) return Qfalse;
-  data->erase(pos);
+// Read the pixel dimensions from the IHDR chunk, which always comes first in a PNG.
+static bool png_dimensions(Exiv2::BasicIo& io, int& width, int& height) {
+  Exiv2::byte buf[8];
+  if (io.seek(16, Exiv2::BasicIo::beg) != 0 || io.read(buf, 8) != 8) return false;
 
-  return Qtrue;
+  width  = Exiv2::getULong(buf, Exiv2::bigEndian);
+  height = Exiv2::getULong(buf + 4, Exiv2::bigEndian);
+  return true;
 }
 
-static VALUE iptc_data_clear(VALUE self) {
-  Exiv2::IptcData* data;
-  Data_Get_Struct(self, Exiv2::IptcData, data);
-
-  data->clear();
+// Read the pixel dimensions from a GIF's logical screen descriptor.
+static bool gif_dimensions(Exiv2::BasicIo& io, int& width, int& height) {
+  Exiv2::byte buf[4];
+  if (io.seek(6, Exiv2::BasicIo::beg) != 0 || io.read(buf, 4) != 4) return false;
 
-  return Qnil;
+  width  = Exiv2::getUShort(buf, Exiv2::littleEndian);
+  height = Exiv2::getUShort(buf + 2, Exiv2::littleEndian);
+  return true;
 }
 
-// Exiv2::XmpData methods
+struct ProbeCall {
+  const char* path;
+  long path_length;
+  VALUE buffer;
+  std::string mime_type;
+  int width;
+  int height;
+};
+
+// Work out an image's type and dimensions. Opening it only reads enough to recognise the
+// type, and for the common formats that keep their dimensions in a fixed header, that's
+// all that's read. Other formats fall back to reading the metadata, which is thrown away.
+static void probe_without_gvl(ProbeCall* call) {
+  Exiv2::Image::AutoPtr image;
+  if (call->path) {
+    image = Exiv2::ImageFactory::open(std::string(call->path, call->path_length));
+  }
+  else {
+    Exiv2::BasicIo::AutoPtr io(new StringIo(call->buffer));
+    image = Exiv2::ImageFactory::open(io);
+  }
+
+  call->mime_type = image->mimeType();
+
+  bool found = false;
+  Exiv2::BasicIo& io = image->io();
+  if (io.open() == 0) {
+    if (call->mime_type == "image/jpeg")
+      found = jpeg_dimensions(io, call->width, call->height);
+    else if (call->mime_type == "image/png")
+      found = png_dimensions(io, call->width, call->height);
+    else if (call->mime_type == "image/gif")
+      found = gif_dimensions(io, call->width, call->height);
+    io.close();
+  }
 
-static VALUE xmp_data_each(VALUE self) {
-  return metadata_each<Exiv2::XmpData>(self);
+  if (!found) {
+    image->readMetadata();
+    call->width = image->pixelWidth();
+    call->height = image->pixelHeight();
+  }
 }
 
-static VALUE xmp_data_add(VALUE self, VALUE key, VALUE value) {
-  Exiv2::XmpData* data;
-  Data_Get_Struct(self, Exiv2::XmpData, data);
+// A short name for the type of image with a MIME type, like :jpeg or :cr2. Exiv2's own
+// image type numbers depend on the version and how it was built, so they're not used.
+// Most MIME types Exiv2 gives end with the name, after "image/x-vendor-"; the rest are
+// listed.
+static VALUE image_type_name(const std::string& mime_type) {
+  static const struct { const char* mime_type; const char* name; } names[] = {
+    { "application/rdf+xml", "xmp" },
+    { "application/postscript", "eps" },
+    { "image/x-photoshop", "psd" },
+    { "image/targa", "tga" },
+    { "image/x-ms-bmp", "bmp" },
+  };
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (mime_type == names[i].mime_type) return ID2SYM(rb_intern(names[i].name));
+  }
 
-  (*data)[to_std_string(key)] = value_to_std_string(value);
+  std::string::size_type start = mime_type.find_last_of("/-");
+  std::string name = start == std::string::npos ? mime_type : mime_type.substr(start + 1);
+  if (name.empty()) return Qnil;
+  return ID2SYM(rb_intern2(name.data(), name.length()));
+}
 
-  return Qtrue;
+static VALUE probe_result(ProbeCall& call) {
+  return rb_struct_new(probe_result_class,
+    image_type_name(call.mime_type),
+    to_ruby_string(call.mime_type),
+    call.width > 0 ? INT2NUM(call.width) : Qnil,
+    call.height > 0 ? INT2NUM(call.height) : Qnil);
 }
 
-static VALUE xmp_data_delete(VALUE self, VALUE key) {
-  Exiv2::XmpData* data;
-  Data_Get_Struct(self, Exiv2::XmpData, data);
+static VALUE exiv2_probe(VALUE self, VALUE path) {
+  path = rb_str_new_frozen(StringValue(path)); // Nobody else can change it while we don't hold the GVL.
 
-  Exiv2::XmpKey xmpKey = Exiv2::XmpKey(to_std_string(key));
-  Exiv2::XmpData::iterator pos = data->findKey(xmpKey);
-  if(pos == data->end()) return Qfalse;
-  data->erase(pos);
+  ProbeCall call = { RSTRING_PTR(path), RSTRING_LEN(path), Qnil, std::string(), 0, 0 };
+  without_gvl(probe_without_gvl, &call);
+  RB_GC_GUARD(path);
 
-  return Qtrue;
+  return probe_result(call);
 }
 
-static VALUE xmp_data_clear(VALUE self) {
-  Exiv2::XmpData* data;
-  Data_Get_Struct(self, Exiv2::XmpData, data);
+static VALUE exiv2_probe_buffer(VALUE self, VALUE buffer) {
+  buffer = rb_str_new_frozen(StringValue(buffer)); // Shares the bytes with the original string, rather than copying them.
 
-  data->clear();
+  ProbeCall call = { NULL, 0, buffer, std::string(), 0, 0 };
+  without_gvl(probe_without_gvl, &call);
+  RB_GC_GUARD(buffer);
 
-  return Qnil;
+  return probe_result(call);
 }
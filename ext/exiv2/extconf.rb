@@ -9,4 +9,9 @@ if dir_config("exiv2") == [nil, nil]
   pkg_config("exiv2")
 end
 have_library("exiv2")
+have_func("rb_hash_new_capa", "ruby.h")
+have_func("rb_enc_interned_str", "ruby/encoding.h")
+have_func("rb_gc_adjust_memory_usage", "ruby.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+have_const("RUBY_TYPED_FROZEN_SHAREABLE", "ruby.h")
 create_makefile("exiv2/exiv2")
@@ -4,3 +4,5 @@ require 'exiv2/shared_methods'
 require 'exiv2/exif_data'
 require 'exiv2/iptc_data'
 require 'exiv2/xmp_data'
+require 'exiv2/batch'
+require 'exiv2/instrumentation'
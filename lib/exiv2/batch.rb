@@ -0,0 +1,35 @@
+# coding: utf-8
+require 'etc'
+
+module Exiv2
+  # Open and read the metadata of many images at once, on a pool of native threads.
+  # Yields each path with a hash of its metadata (only the given keys, if there are
+  # any), in the order the images finish, or with the error from opening or reading it.
+  def self.read_many(paths, threads: Etc.nprocessors, keys: nil, &block)
+    return enum_for(:read_many, paths, threads: threads, keys: keys) unless block
+    _read_many(paths.to_a, threads, keys && keys.to_a, &block)
+  end
+
+  # Read the same keys from many images at once, on a pool of native threads, into a
+  # column for each key rather than a hash for each image. keys can be an array, or a hash
+  # of each key's column type (:int64, :float64 or :string, or nil for the type that suits
+  # the key). Returns an Exiv2::Extraction, whose columns are Exiv2::Columns of packed
+  # values in the order of paths, ready to be handed to Arrow. Images that couldn't be read
+  # are nulls in every column, with their errors in errors. Only the first component of
+  # values with more than one is used. Each key can only be given once.
+  def self.extract(paths, keys:, threads: Etc.nprocessors)
+    names, types = keys.is_a?(Hash) ? [keys.keys, keys.values] : [keys.to_a, []]
+    duplicates = names.map(&:to_s).group_by(&:itself).select { |_, same| same.size > 1 }.keys
+    raise ArgumentError, "keys given more than once: #{duplicates.join(', ')}" unless duplicates.empty?
+    _extract(paths.to_a, threads, names, types)
+  end
+
+  # Make the same changes to the metadata of many images at once, on a pool of native
+  # threads. exif, iptc and xmp are hashes of keys and values, like update takes. Yields
+  # each path with whether it was written (images that already have the values are left
+  # alone), in the order the images finish, or with the error from opening or writing it.
+  def self.write_many(paths, exif: {}, iptc: {}, xmp: {}, threads: Etc.nprocessors, &block)
+    return enum_for(:write_many, paths, exif: exif, iptc: iptc, xmp: xmp, threads: threads) unless block
+    _write_many(paths.to_a, threads, exif, iptc, xmp, &block)
+  end
+end
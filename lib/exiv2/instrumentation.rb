@@ -0,0 +1,49 @@
+# coding: utf-8
+module Exiv2
+  class << self
+    # Something that responds to instrument(name, payload) { ... }, such as
+    # ActiveSupport::Notifications, to be told about every open, read_metadata and
+    # write_metadata as it happens. Events are named "open.exiv2", "read_metadata.exiv2"
+    # and "write_metadata.exiv2".
+    attr_accessor :instrumenter
+  end
+
+  module Instrumentation
+    module ImageFactory
+      def open(path, **options)
+        instrumenter = Exiv2.instrumenter
+        return super unless instrumenter
+        instrumenter.instrument("open.exiv2", path: path) { super }
+      end
+
+      def open_buffer(buffer)
+        instrumenter = Exiv2.instrumenter
+        return super unless instrumenter
+        instrumenter.instrument("open.exiv2", bytesize: buffer.bytesize) { super }
+      end
+
+      def open_io(io)
+        instrumenter = Exiv2.instrumenter
+        return super unless instrumenter
+        instrumenter.instrument("open.exiv2", io: io) { super }
+      end
+    end
+
+    module Image
+      def read_metadata(**options)
+        instrumenter = Exiv2.instrumenter
+        return super unless instrumenter
+        instrumenter.instrument("read_metadata.exiv2", image: self) { super }
+      end
+
+      def write_metadata(**options)
+        instrumenter = Exiv2.instrumenter
+        return super unless instrumenter
+        instrumenter.instrument("write_metadata.exiv2", image: self) { super }
+      end
+    end
+  end
+
+  ImageFactory.singleton_class.prepend(Instrumentation::ImageFactory)
+  Image.prepend(Instrumentation::Image)
+end
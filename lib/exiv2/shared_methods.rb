@@ -1,22 +1,5 @@
 # coding: utf-8
 module SharedMethods
-  def to_hash
-    result = {}
-
-    self.each do |key, value|
-      if result[key]
-        if result[key].is_a? Array
-          result[key] << value
-        else
-          result[key] = [result[key], value]
-        end
-      else
-        result[key] = value
-      end
-    end
-    result
-  end
-
   def inspect
     items = []
     self.to_hash.sort.each do |k,v|
@@ -25,25 +8,21 @@ module SharedMethods
     "#<#{self.class.name}: {#{items.join(', ')}}>"
   end
   
-  def [](key) 
-    self.to_hash[key]
+  def fetch(key, *default)
+    value = self[key]
+    return value unless value.nil?
+    return yield(key) if block_given?
+    return default.first unless default.empty?
+    raise KeyError, "key not found: #{key.inspect}"
   end
   
   def []=(key, value)
+    values = value.is_a?(Array) ? value : [value]
+    return if _unchanged?(key, values)
+
     delete_all(key)
-    if value.is_a?(Array)
-      value.each do |v|
-        self.add(key, v)
-      end
-    else
-      self.add(key, value)
+    values.each do |v|
+      self.add(key, v)
     end
   end
-  
-  def delete_all(key)
-    del = true
-    while(del) do
-      del = self.delete(key)
-    end 
-  end
 end
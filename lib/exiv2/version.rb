@@ -1,4 +1,4 @@
 # coding: utf-8
 module Exiv2
-  VERSION = "0.1.1"
+  VERSION = "0.1.1".freeze
 end
@@ -2,6 +2,7 @@
 require 'bundler/setup'
 require 'exiv2'
 require 'fileutils'
+require 'stringio'
 
 RSpec.describe Exiv2 do
 
@@ -17,6 +18,128 @@ RSpec.describe Exiv2 do
     }.to raise_error(Exiv2::BasicError)
   end
 
+  it "should read metadata from several threads at once" do
+    threads = 4.times.map do
+      Thread.new do
+        image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+        image.read_metadata
+        image.iptc_data.to_hash
+      end
+    end
+    threads.each do |thread|
+      expect(thread.value["Iptc.Application2.Caption"]).to eq("Rhubarb rhubarb rhubard")
+    end
+  end
+
+  it "should raise an error when trying to open a file that isn't an image" do
+    FileUtils.cp("README.md", "spec/files/test_tmp.jpg")
+    expect {
+      Exiv2::ImageFactory.open("spec/files/test_tmp.jpg")
+    }.to raise_error(Exiv2::BasicError)
+    FileUtils.rm("spec/files/test_tmp.jpg")
+  end
+
+  it "should open an image from a string" do
+    image = Exiv2::ImageFactory.open_buffer(File.binread("spec/files/test.jpg"))
+    image.read_metadata
+    expect(image.iptc_data["Iptc.Application2.Caption"]).to eq("Rhubarb rhubarb rhubard")
+  end
+
+  it "should not be affected by changes to the string an image was opened from" do
+    buffer = File.binread("spec/files/test.jpg")
+    image = Exiv2::ImageFactory.open_buffer(buffer)
+    buffer.replace("not an image")
+    GC.start
+    image.read_metadata
+    expect(image.exif_data["Exif.Image.Software"]).to eq("plasq skitch")
+  end
+
+  it "should raise an error when trying to open a string that isn't an image" do
+    expect {
+      Exiv2::ImageFactory.open_buffer("not an image")
+    }.to raise_error(Exiv2::BasicError)
+  end
+
+  it "should open an image from an IO" do
+    File.open("spec/files/test.jpg", "rb") do |file|
+      image = Exiv2::ImageFactory.open_io(file)
+      image.read_metadata
+      expect(image.iptc_data["Iptc.Application2.Caption"]).to eq("Rhubarb rhubarb rhubard")
+      expect(image.exif_data["Exif.Image.Software"]).to eq("plasq skitch")
+    end
+  end
+
+  it "should open an image from a StringIO" do
+    image = Exiv2::ImageFactory.open_io(StringIO.new(File.binread("spec/files/test.jpg")))
+    image.read_metadata
+    expect(image.iptc_data["Iptc.Application2.Caption"]).to eq("Rhubarb rhubarb rhubard")
+  end
+
+  it "should raise the error from an IO that fails while being read" do
+    io = StringIO.new(File.binread("spec/files/test.jpg"))
+    def io.read(*) raise IOError, "broken pipe" end
+    expect {
+      Exiv2::ImageFactory.open_io(io)
+    }.to raise_error(IOError, "broken pipe")
+  end
+
+  it "should not write an image opened from an IO" do
+    image = Exiv2::ImageFactory.open_io(StringIO.new(File.binread("spec/files/test.jpg")))
+    image.read_metadata
+    expect { image.write_metadata }.to raise_error(Exiv2::BasicError)
+  end
+
+  it "should only keep the types of metadata asked for" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata(only: [:exif])
+    expect(image.exif_data.to_hash).not_to be_empty
+    expect(image.iptc_data.to_hash).to be_empty
+    expect(image.xmp_data.to_hash).to be_empty
+  end
+
+  it "should only keep the keys asked for" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata(keys: ["Exif.Image.Software", "Iptc.Application2.Keywords"])
+    expect(image.exif_data.to_hash).to eq("Exif.Image.Software" => "plasq skitch")
+    expect(image.iptc_data.to_hash).to eq("Iptc.Application2.Keywords" => ["fish", "custard"])
+    expect(image.xmp_data.to_hash).to be_empty
+  end
+
+  it "should reject unknown types of metadata" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    expect { image.read_metadata(only: [:exif, :bogus]) }.to raise_error(ArgumentError)
+  end
+
+  it "should not write metadata that has only been partly read" do
+    FileUtils.cp("spec/files/test.jpg", "spec/files/test_tmp.jpg")
+    image = Exiv2::ImageFactory.open("spec/files/test_tmp.jpg")
+    image.read_metadata(only: [:iptc])
+    expect { image.write_metadata }.to raise_error(Exiv2::BasicError)
+
+    image.read_metadata
+    expect { image.write_metadata }.not_to raise_error
+    FileUtils.rm("spec/files/test_tmp.jpg")
+  end
+
+  it "should probe an image's type and dimensions" do
+    probe = Exiv2.probe("spec/files/test.jpg")
+    expect(probe).to be_a(Exiv2::ProbeResult)
+    expect(probe.mime_type).to eq("image/jpeg")
+    expect([probe.width, probe.height]).to eq([32, 32])
+    expect(probe.type).to eq(:jpeg)
+  end
+
+  it "should probe an image in a string" do
+    probe = Exiv2.probe_buffer(File.binread("spec/files/photo_with_utf8_description.jpg"))
+    expect(probe.mime_type).to eq("image/jpeg")
+    expect([probe.width, probe.height]).to eq([10, 10])
+  end
+
+  it "should raise an error when probing something that isn't an image" do
+    expect { Exiv2.probe_buffer("not an image") }.to raise_error(Exiv2::BasicError)
+    expect { Exiv2.probe("tmp/no-such-file.jpg") }.to raise_error(Exiv2::BasicError)
+  end
+
   it "should write metadata" do
     FileUtils.cp("spec/files/test.jpg", "spec/files/test_tmp.jpg")
     image = Exiv2::ImageFactory.open("spec/files/test_tmp.jpg")
@@ -31,6 +154,350 @@ RSpec.describe Exiv2 do
     FileUtils.rm("spec/files/test_tmp.jpg")
   end
 
+  it "should read metadata from a memory-mapped file" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg", mmap: true)
+    image.read_metadata
+    expect(image.iptc_data["Iptc.Application2.Caption"]).to eq("Rhubarb rhubarb rhubard")
+    expect(image.exif_data["Exif.Image.Software"]).to eq("plasq skitch")
+  end
+
+  it "should track whether metadata has changed since it was read" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    expect(image).to be_dirty
+    image.read_metadata
+    expect(image).not_to be_dirty
+
+    image.iptc_data["Iptc.Application2.Caption"] = "Rhubarb rhubarb rhubard"
+    image.exif_data["Exif.Image.Software"] = "plasq skitch"
+    expect(image).not_to be_dirty
+
+    image.iptc_data["Iptc.Application2.Caption"] = "A New Caption"
+    expect(image).to be_dirty
+  end
+
+  it "should update several keys at once" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    iptc_data = image.iptc_data
+    expect(iptc_data.update(
+      "Iptc.Application2.Caption" => "A New Caption",
+      "Iptc.Application2.Keywords" => ["fish", "chips"],
+      "Iptc.Application2.DateCreated" => nil
+    )).to equal(iptc_data)
+
+    expect(iptc_data["Iptc.Application2.Caption"]).to eq("A New Caption")
+    expect(iptc_data["Iptc.Application2.Keywords"]).to eq(["fish", "chips"])
+    expect(iptc_data["Iptc.Application2.DateCreated"]).to be_nil
+    expect(image).to be_dirty
+  end
+
+  it "should raise BasicError when adding or deleting an invalid key" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+
+    [image.exif_data, image.iptc_data, image.xmp_data].each do |data|
+      expect { data.add("Bogus", "1") }.to raise_error(Exiv2::BasicError)
+      expect { data.delete("Bogus") }.to raise_error(Exiv2::BasicError)
+    end
+    expect(image).not_to be_dirty
+  end
+
+  it "should leave data alone when an update doesn't change it" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    before = image.exif_data.to_hash
+    image.exif_data.update("Exif.Image.Software" => "plasq skitch")
+    expect(image.exif_data.to_hash).to eq(before)
+    expect(image).not_to be_dirty
+  end
+
+  it "should update an XMP array as a single datum" do
+    FileUtils.cp("spec/files/test.jpg", "spec/files/test_tmp.jpg")
+    image = Exiv2::ImageFactory.open("spec/files/test_tmp.jpg")
+    image.read_metadata
+    image.xmp_data.update("Xmp.dc.subject" => ["fish", "chips"])
+    expect(image.xmp_data["Xmp.dc.subject"]).to eq(["fish", "chips"])
+    expect(image.xmp_data.count { |key, _| key == "Xmp.dc.subject" }).to eq(1)
+    image.write_metadata
+
+    image.read_metadata
+    image.xmp_data.update("Xmp.dc.subject" => ["fish", "chips"])
+    expect(image).not_to be_dirty
+    image.xmp_data["Xmp.dc.subject"] = ["fish", "chips"]
+    expect(image).not_to be_dirty
+    FileUtils.rm("spec/files/test_tmp.jpg")
+  end
+
+  it "should not rewrite a file when nothing has changed" do
+    FileUtils.cp("spec/files/test.jpg", "spec/files/test_tmp.jpg")
+    File.utime(Time.at(0), Time.at(0), "spec/files/test_tmp.jpg")
+    image = Exiv2::ImageFactory.open("spec/files/test_tmp.jpg")
+    image.read_metadata
+    image.iptc_data["Iptc.Application2.Caption"] = "Rhubarb rhubarb rhubard"
+    image.write_metadata
+    expect(File.mtime("spec/files/test_tmp.jpg")).to eq(Time.at(0))
+
+    image.iptc_data.delete("Iptc.Application2.Caption")
+    image.write_metadata
+    expect(File.mtime("spec/files/test_tmp.jpg")).not_to eq(Time.at(0))
+    expect(image).not_to be_dirty
+    FileUtils.rm("spec/files/test_tmp.jpg")
+  end
+
+  it "should write metadata to a memory-mapped file" do
+    FileUtils.cp("spec/files/test.jpg", "spec/files/test_tmp.jpg")
+    image = Exiv2::ImageFactory.open("spec/files/test_tmp.jpg", mmap: true)
+    image.read_metadata
+    image.iptc_data["Iptc.Application2.Caption"] = "A New Caption"
+    image.write_metadata
+    image.read_metadata
+    expect(image.iptc_data["Iptc.Application2.Caption"]).to eq("A New Caption")
+    image = nil
+
+    image2 = Exiv2::ImageFactory.open("spec/files/test_tmp.jpg")
+    image2.read_metadata
+    expect(image2.iptc_data["Iptc.Application2.Caption"]).to eq("A New Caption")
+    FileUtils.rm("spec/files/test_tmp.jpg")
+  end
+
+  it "should write metadata to a string without changing the file" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    image.iptc_data["Iptc.Application2.Caption"] = "A New Caption"
+    buffer = image.write_metadata(to: String.new)
+    expect(buffer.encoding).to eq(Encoding::BINARY)
+
+    image2 = Exiv2::ImageFactory.open_buffer(buffer)
+    image2.read_metadata
+    expect(image2.iptc_data["Iptc.Application2.Caption"]).to eq("A New Caption")
+    expect(image2.exif_data["Exif.Image.Software"]).to eq("plasq skitch")
+
+    image3 = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image3.read_metadata
+    expect(image3.iptc_data["Iptc.Application2.Caption"]).to eq("Rhubarb rhubarb rhubard")
+  end
+
+  it "should write metadata from an image opened from an IO to another IO" do
+    image = Exiv2::ImageFactory.open_io(StringIO.new(File.binread("spec/files/test.jpg")))
+    image.read_metadata
+    image.iptc_data["Iptc.Application2.Caption"] = "A New Caption"
+    output = StringIO.new(String.new)
+    expect(image.write_metadata(to: output)).to equal(output)
+
+    image2 = Exiv2::ImageFactory.open_buffer(output.string)
+    image2.read_metadata
+    expect(image2.iptc_data["Iptc.Application2.Caption"]).to eq("A New Caption")
+  end
+
+  it "should share an ICC profile between images" do
+    data = [128].pack("N") + "\0".b * 124 # Just big enough to pass Exiv2's check.
+    profile = Exiv2::IccProfile.new(data)
+    expect(profile.size).to eq(128)
+
+    2.times do
+      image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+      image.read_metadata
+      expect(image.icc_profile).to be_nil
+      image.set_icc_profile(profile)
+      expect(image).to have_icc_profile
+      expect(image.icc_profile).to eq(data)
+      expect(image.icc_profile).to be_frozen
+    end
+  end
+
+  it "should count each phase when stats are enabled" do
+    Exiv2.stats_enabled = true
+    Exiv2.reset_stats
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    image.iptc_data.to_hash
+
+    stats = Exiv2.stats
+    expect(stats[:open][:calls]).to eq(1)
+    expect(stats[:read][:calls]).to eq(1)
+    expect(stats[:read][:bytes]).to eq(File.size("spec/files/test.jpg"))
+    expect(stats[:convert][:calls]).to eq(1)
+    expect(stats[:convert][:values]).to eq(3)
+    expect(stats[:convert][:objects]).to be > 0
+    expect(stats[:write][:calls]).to eq(0)
+    expect(stats[:read][:max_ns]).to be <= stats[:read][:total_ns]
+
+    Exiv2.reset_stats
+    expect(Exiv2.stats[:open][:calls]).to eq(0)
+  ensure
+    Exiv2.stats_enabled = false
+  end
+
+  it "should leave the time spent in each's block out of the convert phase" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    Exiv2.stats_enabled = true
+    Exiv2.reset_stats
+    image.iptc_data.each { sleep 0.05 }
+
+    convert = Exiv2.stats[:convert]
+    expect(convert[:calls]).to eq(1)
+    expect(convert[:values]).to eq(3)
+    expect(convert[:total_ns]).to be < 50_000_000
+  ensure
+    Exiv2.stats_enabled = false
+  end
+
+  it "should not count anything while stats are disabled" do
+    Exiv2.reset_stats
+    Exiv2::ImageFactory.open("spec/files/test.jpg").read_metadata
+    expect(Exiv2.stats.values.map { |phase| phase[:calls] }).to all(eq(0))
+  end
+
+  it "should tell the instrumenter about each phase" do
+    events = []
+    Exiv2.instrumenter = Object.new.tap do |instrumenter|
+      instrumenter.define_singleton_method(:instrument) do |name, payload, &block|
+        events << name
+        block.call
+      end
+    end
+
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata(only: [:iptc])
+    expect(image).to be_a(Exiv2::Image)
+    expect(events).to eq(["open.exiv2", "read_metadata.exiv2"])
+  ensure
+    Exiv2.instrumenter = nil
+  end
+
+  it "should make ICC profiles shareable between Ractors", if: defined?(Ractor) do
+    profile = Exiv2::IccProfile.new([128].pack("N") + "\0".b * 124)
+    expect(profile).to be_frozen
+    expect(Ractor.shareable?(profile)).to be true
+  end
+
+  it "should read metadata in a Ractor", if: defined?(Ractor) do
+    experimental, Warning[:experimental] = Warning[:experimental], false
+    ractor = Ractor.new do
+      image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+      image.read_metadata
+      image.iptc_data.to_hash
+    end
+    Warning[:experimental] = experimental
+
+    expect(ractor.respond_to?(:value) ? ractor.value : ractor.take).to eq(
+      "Iptc.Application2.Caption"  => "Rhubarb rhubarb rhubard",
+      "Iptc.Application2.Keywords" => ["fish", "custard"]
+    )
+  end
+
+  it "should read an ICC profile from a file once" do
+    data = [128].pack("N") + "\0".b * 124
+    File.binwrite("spec/files/test_tmp.icc", data)
+    profile = Exiv2::IccProfile.read("spec/files/test_tmp.icc")
+    FileUtils.rm("spec/files/test_tmp.icc")
+
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.set_icc_profile(profile)
+    expect(image.icc_profile).to eq(data)
+  end
+
+  it "should return the raw XMP packet" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    expect(image.xmp_packet).to be_nil
+    image.read_metadata
+    packet = image.xmp_packet
+    expect(packet).to start_with("<?xpacket begin=")
+    expect(packet).to include("<x:xmpmeta")
+    expect(packet.encoding).to eq(Encoding::UTF_8)
+  end
+
+  it "should reset the XMP data from a packet after they've been changed" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    packet = image.xmp_packet
+    original = image.xmp_data.to_hash
+
+    image.xmp_data["Xmp.dc.title"] = "A new title"
+    image.set_xmp_packet(packet)
+    expect(image.xmp_data.to_hash).to eq(original)
+  end
+
+  it "should raise on an XMP packet that can't be decoded" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    original = image.xmp_data.to_hash
+
+    expect { image.set_xmp_packet("<x:xmpmeta><rdf:RDF>not XMP") }.to raise_error(Exiv2::BasicError)
+    expect(image.xmp_data.to_hash).to eq(original)
+    expect(image).not_to be_dirty
+  end
+
+  it "should find the XMP packet without reading the metadata" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    packet = image.xmp_packet(scan: true)
+    expect(packet).to start_with("<?xpacket begin=")
+    expect(packet).to match(/<\?xpacket end=.*\?>\z/)
+    expect(image.xmp_data.to_hash).to be_empty
+  end
+
+  it "should turn Exif and IPTC data into blobs and back" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+
+    exif_blob = image.exif_data.to_blob
+    iptc_blob = image.iptc_data.to_blob
+    expect(exif_blob.encoding).to eq(Encoding::BINARY)
+
+    expect(Exiv2::ExifData.from_blob(exif_blob).to_hash).to eq(image.exif_data.to_hash)
+    expect(Exiv2::IptcData.from_blob(iptc_blob).to_hash).to eq(image.iptc_data.to_hash)
+  end
+
+  it "should raise an error when decoding a blob that isn't Exif data" do
+    expect { Exiv2::ExifData.from_blob("not exif") }.to raise_error(Exiv2::BasicError)
+  end
+
+  it "should list and extract embedded previews" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    previews = image.previews
+    expect(previews).to all(be_a(Exiv2::PreviewProperties))
+
+    previews.each_with_index do |preview, index|
+      expect(image.preview_data(index).bytesize).to eq(preview.size)
+    end
+    expect { image.preview_data(previews.size) }.to raise_error(IndexError)
+  end
+
+  it "should free an image when it's closed" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+    exif_data = image.exif_data
+    expect(image).not_to be_closed
+    image.close
+    expect(image).to be_closed
+
+    expect { image.read_metadata }.to raise_error(IOError)
+    expect { exif_data.to_hash }.to raise_error(IOError)
+    expect { image.close }.not_to raise_error
+  end
+
+  it "should not close an image while its data are being iterated over" do
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image.read_metadata
+
+    expect { image.exif_data.each { image.close } }.to raise_error(IOError)
+    expect { image.iptc_data.each_datum { image.close } }.to raise_error(IOError)
+    expect(image).not_to be_closed
+
+    image.close
+    expect(image).to be_closed
+  end
+
+  it "should report the memory an image's metadata takes up" do
+    require 'objspace'
+    image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    before = ObjectSpace.memsize_of(image)
+    image.read_metadata
+    expect(ObjectSpace.memsize_of(image)).to be > before
+  end
+
   it 'reads UTF-8 data' do
     image = Exiv2::ImageFactory.open(Pathname.new("spec/files/photo_with_utf8_description.jpg").to_s)
     image.read_metadata
@@ -52,12 +519,159 @@ RSpec.describe Exiv2 do
     end
   end
   
+  it "returns frozen keys that are shared between images" do
+    image1 = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image1.read_metadata
+    image2 = Exiv2::ImageFactory.open("spec/files/test.jpg")
+    image2.read_metadata
+
+    key1 = image1.exif_data.to_hash.keys.first
+    key2 = image2.exif_data.map(&:first).first
+    expect(key1).to be_frozen
+    expect(key2).to be_frozen
+    expect(key1).to equal(key2) if RUBY_VERSION >= "3.0"
+  end
+
   let(:image) do
     image = Exiv2::ImageFactory.open("spec/files/test.jpg")
     image.read_metadata
     image
   end
 
+  context "reading many images" do
+    let(:paths) { ["spec/files/test.jpg", "spec/files/photo_with_utf8_description.jpg", "tmp/no-such-file.jpg"] }
+
+    it "should read the metadata of each image" do
+      results = {}
+      Exiv2.read_many(paths, threads: 2) do |path, metadata, error|
+        results[path] = [metadata, error]
+      end
+
+      expect(results.keys).to match_array(paths)
+      expect(results["spec/files/test.jpg"]).to eq([
+        image.exif_data.to_hash.merge(image.iptc_data.to_hash).merge(image.xmp_data.to_hash),
+        nil
+      ])
+      expect(results["spec/files/photo_with_utf8_description.jpg"][0]["Exif.Image.ImageDescription"]).to eq('UTF-8 description. ☃ł㌎')
+    end
+
+    it "should report errors for each image instead of stopping" do
+      metadata, error = Exiv2.read_many(paths).to_a.find { |path, _, _| path == "tmp/no-such-file.jpg" }.drop(1)
+      expect(metadata).to eq(nil)
+      expect(error).to be_a(Exiv2::BasicError)
+    end
+
+    it "should only read the given keys" do
+      results = Exiv2.read_many(paths.first(1), keys: ["Iptc.Application2.Keywords", "Exif.Image.Software", "Exif.Image.Artist"]).to_a
+      expect(results).to eq([
+        ["spec/files/test.jpg", { "Iptc.Application2.Keywords" => ["fish", "custard"], "Exif.Image.Software" => "plasq skitch" }, nil]
+      ])
+    end
+
+    it "should stop when the block breaks" do
+      expect(Exiv2.read_many(paths * 10, threads: 2) { |path, *| break path }).to be_a(String)
+    end
+  end
+
+  context "extract" do
+    let(:paths) { ["spec/files/test.jpg", "tmp/no-such-file.jpg", "spec/files/photo_with_utf8_description.jpg"] }
+
+    it "should read each key into a column" do
+      extraction = Exiv2.extract(paths, keys: ["Exif.Image.Software", "Exif.Photo.PixelXDimension", "Iptc.Application2.Keywords"], threads: 2)
+      expect(extraction.length).to eq(3)
+      expect(extraction.columns.keys).to eq(["Exif.Image.Software", "Exif.Photo.PixelXDimension", "Iptc.Application2.Keywords"])
+
+      software = extraction.columns["Exif.Image.Software"]
+      expect(software.type).to eq(:string)
+      expect(software.offsets.unpack("l*")[0, 2]).to eq([0, "plasq skitch".bytesize])
+      expect(software.data).to start_with("plasq skitch")
+
+      width = extraction.columns["Exif.Photo.PixelXDimension"]
+      expect(width.type).to eq(:int64)
+      expect(width.data.unpack("q*")[0]).to eq(32)
+      expect(width.validity.unpack1("b*")[0, 3]).to start_with("10")
+
+      keywords = extraction.columns["Iptc.Application2.Keywords"]
+      expect(keywords.data.byteslice(0, keywords.offsets.unpack("l*")[1])).to eq("fish")
+    end
+
+    it "should leave images it couldn't read as nulls, with their errors" do
+      extraction = Exiv2.extract(paths, keys: { "Exif.Photo.PixelXDimension" => :float64 })
+      column = extraction.columns["Exif.Photo.PixelXDimension"]
+      expect(column.type).to eq(:float64)
+      expect(column.data.unpack("d*")[0]).to eq(32.0)
+      expect(column.validity.unpack1("b*")[1]).to eq("0")
+      expect(column.null_count).to be >= 1
+      expect(extraction.errors.keys).to eq(["tmp/no-such-file.jpg"])
+      expect(extraction.errors["tmp/no-such-file.jpg"]).to be_a(Exiv2::BasicError)
+    end
+
+    it "should raise on keys given more than once" do
+      expect { Exiv2.extract(paths, keys: ["Exif.Image.Software", "Exif.Image.Software"]) }.to raise_error(ArgumentError)
+    end
+
+    it "should raise on unknown column types" do
+      expect { Exiv2.extract(paths, keys: { "Exif.Image.Software" => :decimal }) }.to raise_error(ArgumentError)
+    end
+  end
+
+  context "write_many" do
+    let(:paths) { ["spec/files/test_tmp1.jpg", "spec/files/test_tmp2.jpg"] }
+
+    before do
+      paths.each { |path| FileUtils.cp("spec/files/test.jpg", path) }
+    end
+
+    after do
+      paths.each { |path| FileUtils.rm_f(path) }
+    end
+
+    it "should write the changes to each image" do
+      results = Exiv2.write_many(paths, threads: 2, iptc: { "Iptc.Application2.Caption" => "A New Caption" }, exif: { "Exif.Image.Software" => nil }).to_a
+      expect(results).to match_array(paths.map { |path| [path, true, nil] })
+
+      paths.each do |path|
+        image = Exiv2::ImageFactory.open(path)
+        image.read_metadata
+        expect(image.iptc_data["Iptc.Application2.Caption"]).to eq("A New Caption")
+        expect(image.iptc_data["Iptc.Application2.Keywords"]).to eq(["fish", "custard"])
+        expect(image.exif_data["Exif.Image.Software"]).to eq(nil)
+      end
+    end
+
+    it "should skip images that already have the values" do
+      mtime = File.mtime(paths.first)
+      results = Exiv2.write_many(paths.first(1), iptc: { "Iptc.Application2.Caption" => "Rhubarb rhubarb rhubard" }).to_a
+      expect(results).to eq([[paths.first, false, nil]])
+      expect(File.mtime(paths.first)).to eq(mtime)
+    end
+
+    it "should skip images that already have an XMP array" do
+      xmp = { "Xmp.dc.subject" => ["fish", "chips"] }
+      expect(Exiv2.write_many(paths.first(1), xmp: xmp).to_a).to eq([[paths.first, true, nil]])
+
+      mtime = File.mtime(paths.first)
+      expect(Exiv2.write_many(paths.first(1), xmp: xmp).to_a).to eq([[paths.first, false, nil]])
+      expect(File.mtime(paths.first)).to eq(mtime)
+
+      image = Exiv2::ImageFactory.open(paths.first)
+      image.read_metadata
+      expect(image.xmp_data["Xmp.dc.subject"]).to eq(["fish", "chips"])
+    end
+
+    it "should report errors for each image instead of stopping" do
+      results = Exiv2.write_many(paths + ["tmp/no-such-file.jpg"], exif: { "Exif.Image.Software" => "ruby-exiv2" }).to_a
+      written, error = results.find { |path, _, _| path == "tmp/no-such-file.jpg" }.drop(1)
+      expect(written).to eq(nil)
+      expect(error).to be_a(Exiv2::BasicError)
+      expect(results.count { |_, written, _| written }).to eq(2)
+    end
+
+    it "should raise on invalid keys before writing anything" do
+      expect { Exiv2.write_many(paths, exif: { "Exif.Nonsense.Key" => "1" }).to_a }.to raise_error(Exiv2::BasicError)
+    end
+  end
+
   context "IPTC data" do
     before do
       @iptc_data = image.iptc_data
@@ -82,6 +696,28 @@ RSpec.describe Exiv2 do
       })
     end
     
+    it "should look up IPTC data by key" do
+      expect(@iptc_data["Iptc.Application2.Caption"]).to eq("Rhubarb rhubarb rhubard")
+      expect(@iptc_data["Iptc.Application2.Keywords"]).to eq(["fish", "custard"])
+      expect(@iptc_data["Iptc.Application2.Headline"]).to eq(nil)
+      expect(@iptc_data["Not a key"]).to eq(nil)
+    end
+
+    it "should look up several IPTC keys at once" do
+      expect(@iptc_data.values_at("Iptc.Application2.Keywords", "Iptc.Application2.Headline", "Iptc.Application2.Caption")).to eq([
+        ["fish", "custard"],
+        nil,
+        "Rhubarb rhubarb rhubard"
+      ])
+    end
+
+    it "should fetch IPTC data by key" do
+      expect(@iptc_data.fetch("Iptc.Application2.Caption")).to eq("Rhubarb rhubarb rhubard")
+      expect(@iptc_data.fetch("Iptc.Application2.Headline", "default")).to eq("default")
+      expect(@iptc_data.fetch("Iptc.Application2.Headline") { |key| key }).to eq("Iptc.Application2.Headline")
+      expect { @iptc_data.fetch("Iptc.Application2.Headline") }.to raise_error(KeyError)
+    end
+
     it "should write IPTC data" do
       @iptc_data.add("Iptc.Application2.Keywords", "fishy")
       expect(@iptc_data.to_a).to eq([
@@ -92,6 +728,23 @@ RSpec.describe Exiv2 do
       ])
     end
     
+    it "should read IPTC strings in the encoding given by the character set" do
+      expect(@iptc_data["Iptc.Application2.Caption"].encoding).to eq(Encoding::ISO_8859_1)
+      @iptc_data.add("Iptc.Envelope.CharacterSet", "\e%G")
+      expect(@iptc_data["Iptc.Application2.Caption"].encoding).to eq(Encoding::UTF_8)
+    end
+
+    it "should read IPTC dates and times" do
+      @iptc_data.add("Iptc.Application2.DateCreated", "2020-05-17")
+      @iptc_data.add("Iptc.Application2.TimeCreated", "10:11:12-02:30")
+      expect(@iptc_data["Iptc.Application2.DateCreated"]).to eq(Date.new(2020, 5, 17))
+
+      time = @iptc_data["Iptc.Application2.TimeCreated"]
+      expect(time).to be_a(Time)
+      expect([time.hour, time.min, time.sec, time.utc_offset]).to eq([10, 11, 12, -9000])
+      expect(time.to_date).to eq(Date.today)
+    end
+
     it "should set IPTC data" do
       @iptc_data["Iptc.Application2.Caption"] = "A New Caption"
       expect(@iptc_data.to_hash["Iptc.Application2.Caption"]).to eq("A New Caption")
@@ -111,6 +764,17 @@ RSpec.describe Exiv2 do
       @iptc_data.delete_all("Iptc.Application2.Keywords")
       expect(@iptc_data.to_hash["Iptc.Application2.Keywords"]).to eq(nil)
     end
+
+    it "should delete all values of IPTC data in between other data" do
+      @iptc_data.add("Iptc.Application2.Headline", "A Headline")
+      @iptc_data.add("Iptc.Application2.Keywords", "fishy")
+      expect(@iptc_data.delete_all("Iptc.Application2.Keywords")).to eq(true)
+      expect(@iptc_data.to_a).to eq([
+        ["Iptc.Application2.Caption", "Rhubarb rhubarb rhubard"],
+        ["Iptc.Application2.Headline", "A Headline"]
+      ])
+      expect(@iptc_data.delete_all("Iptc.Application2.Keywords")).to eq(false)
+    end
   end
 
   context "XMP data" do
@@ -136,6 +800,13 @@ RSpec.describe Exiv2 do
       })
     end
 
+    it "should look up XMP data by key" do
+      xmp_hash = @xmp_data.to_hash
+      expect(@xmp_data["Xmp.dc.title"]).to eq(xmp_hash["Xmp.dc.title"])
+      expect(@xmp_data["Xmp.dc.creator"]).to eq(nil)
+      expect(@xmp_data.values_at("Xmp.dc.description", "Xmp.dc.title")).to eq(xmp_hash.values_at("Xmp.dc.description", "Xmp.dc.title"))
+    end
+
     it "should write XMP data" do
       @xmp_data["Xmp.dc.title"] = "lang=\"x-default\" Changed!"
       expect(@xmp_data.to_hash["Xmp.dc.title"]).to eq("lang=\"x-default\" Changed!")
@@ -192,6 +863,14 @@ RSpec.describe Exiv2 do
       })
     end
 
+    it "should look up Exif data by key" do
+      expect(@exif_data["Exif.Image.Software"]).to eq("plasq skitch")
+      expect(@exif_data["Exif.Image.Artist"]).to eq(nil)
+      expect(@exif_data.values_at("Exif.Photo.PixelXDimension", "Exif.Photo.PixelYDimension")).to eq(
+        @exif_data.to_hash.values_at("Exif.Photo.PixelXDimension", "Exif.Photo.PixelYDimension")
+      )
+    end
+
     it "should write Exif data" do
       @exif_data.add("Exif.Image.Software", "ruby-exiv2")
       expect(@exif_data.to_hash).to eq({
@@ -223,5 +902,75 @@ RSpec.describe Exiv2 do
       @exif_data.delete_all("Exif.Image.Software")
       expect(@exif_data.to_hash["Exif.Image.Software"]).to eq(nil)
     end
+
+    it "should set the same keys on many images" do
+      3.times do
+        image = Exiv2::ImageFactory.open("spec/files/test.jpg")
+        image.read_metadata
+        image.exif_data["Exif.Image.Software"] = "ruby-exiv2"
+        image.exif_data["Exif.Photo.PixelXDimension"] = 64
+        expect(image.exif_data["Exif.Image.Software"]).to eq("ruby-exiv2")
+        expect(image.exif_data["Exif.Photo.PixelXDimension"]).to eq(64)
+      end
+    end
+
+    it "should read every component of multi-component values" do
+      @exif_data["Exif.Image.BitsPerSample"] = "8 8 8"
+      @exif_data["Exif.GPSInfo.GPSLatitude"] = "51/1 30/1 2654/100"
+      expect(@exif_data["Exif.Image.BitsPerSample"]).to eq([8, 8, 8])
+      expect(@exif_data.to_hash["Exif.GPSInfo.GPSLatitude"]).to eq([Rational(51), Rational(30), Rational(2654, 100)])
+    end
+
+    it "should read undefined values as binary strings with raw: true" do
+      value = @exif_data.to_hash(raw: true)["Exif.Photo.ExifVersion"]
+      expect(value).to eq("0210".b)
+      expect(value.encoding).to eq(Encoding::BINARY)
+      pairs = []
+      @exif_data.each(raw: true) { |key, v| pairs << [key, v] }
+      expect(pairs.assoc("Exif.Photo.ExifVersion")).to eq(["Exif.Photo.ExifVersion", "0210".b])
+      expect(@exif_data.to_hash["Exif.Photo.ExifVersion"]).to eq("48 50 49 48")
+    end
+
+    it "should walk the data without converting their values" do
+      seen = []
+      handle = nil
+      @exif_data.each_datum do |datum|
+        seen << [datum.key, datum.type, datum.count, datum.size]
+        expect(datum.value).to eq("plasq skitch") if datum.key == "Exif.Image.Software"
+        handle = datum
+      end
+      expect(seen.map(&:first)).to eq(@exif_data.keys)
+      expect(seen.assoc("Exif.Image.Software")).to eq(["Exif.Image.Software", "Ascii", 13, 13])
+      expect { handle.value }.to raise_error(RuntimeError)
+    end
+
+    it "should list and count keys" do
+      expect(@exif_data.keys).to eq(@exif_data.to_a.map(&:first))
+      expect(@exif_data.size).to eq(5)
+      expect(@exif_data.key?("Exif.Image.Software")).to be true
+      expect(@exif_data.key?("Exif.Image.Artist")).to be false
+      expect(@exif_data.key?("Exif.Nonsense.Key")).to be false
+    end
+
+    it "should select the data in a group" do
+      photo = @exif_data.to_hash.select { |key, _| key.start_with?("Exif.Photo.") }
+      expect(@exif_data.select_group("Exif.Photo")).to eq(photo)
+      expect(@exif_data.select_group("Photo")).to eq(photo)
+      expect(@exif_data.select_group("Exif.GPSInfo")).to eq({})
+      expect(@exif_data.select_group("Exif.Nonsense")).to eq({})
+    end
+
+    it "should slice the data by key prefix" do
+      expect(@exif_data.slice_prefix("Exif.Photo.Pixel").keys).to contain_exactly("Exif.Photo.PixelXDimension", "Exif.Photo.PixelYDimension")
+      expect(@exif_data.slice_prefix("Exif.Image.")).to eq(@exif_data.select_group("Exif.Image"))
+      expect(@exif_data.slice_prefix("Exif")).to eq(@exif_data.to_hash)
+      expect(@exif_data.slice_prefix("Xmp.dc.")).to eq({})
+    end
+
+    it "should still raise on invalid keys" do
+      2.times do
+        expect { @exif_data.delete_all("Exif.Nonsense.Key") }.to raise_error(Exiv2::BasicError)
+      end
+    end
   end
 end